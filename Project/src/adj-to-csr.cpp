@@ -0,0 +1,88 @@
+/* Parallel Computing Project S2019
+ * Eric Johnson, Chris Jones, Harrison Lee
+ *
+ * Converts a graph from the text adjacency list format (.adj) to the binary
+ * CSR format described in graph-file.h, which project.out can load much
+ * faster.
+ *
+ * Usage: ./adj-to-csr.out input.adj output.csr
+ */
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "graph-file.h"
+
+using namespace std;
+
+int main(int argc, char **argv) {
+  if (argc != 3) {
+    cout << "ERROR: Was expecting " << argv[0] << " input.adj output.csr"
+         << endl;
+    return 1;
+  }
+  ifstream file(argv[1]);
+  if (!file) {
+    cout << "ERROR: Could not open " << argv[1] << endl;
+    return 2;
+  }
+
+  // First line: number vertices and number edges
+  string line;
+  if (!getline(file, line)) {
+    cout << "ERROR: " << argv[1] << " is empty" << endl;
+    return 2;
+  }
+  char *end;
+  uint64_t num_vertices = strtoull(line.c_str(), &end, 10);
+  uint64_t num_edges = strtoull(end, NULL, 10);
+
+  vector<uint64_t> offsets;
+  vector<uint64_t> destinations;
+  vector<int32_t> capacities;
+  offsets.reserve(num_vertices + 1);
+  destinations.reserve(num_edges);
+  capacities.reserve(num_edges);
+  offsets.push_back(0);
+
+  // Line i holds the "to" node and capacity of each out-edge of vertex i
+  while (offsets.size() <= num_vertices && getline(file, line)) {
+    const char *pos = line.c_str();
+    while (true) {
+      uint64_t dest = strtoull(pos, &end, 10);
+      if (end == pos)
+        break;
+      pos = end;
+      long capacity = strtol(pos, &end, 10);
+      if (end == pos)
+        break;
+      pos = end;
+      if (dest >= num_vertices) {
+        cout << "ERROR: Edge to vertex " << dest << " on line "
+             << offsets.size() + 1 << ", but there are only " << num_vertices
+             << " vertices" << endl;
+        return 2;
+      }
+      destinations.push_back(dest);
+      capacities.push_back(capacity);
+    }
+    offsets.push_back(destinations.size());
+  }
+  // vertices without a line in the file have no out-edges
+  offsets.resize(num_vertices + 1, destinations.size());
+  if (destinations.size() != num_edges) {
+    cout << "WARNING: Header says " << num_edges << " edges, but found "
+         << destinations.size() << endl;
+  }
+
+  if (!write_csr_file(argv[2], offsets, destinations, capacities)) {
+    cout << "ERROR: Could not write " << argv[2] << endl;
+    return 3;
+  }
+  cout << "Wrote " << num_vertices << " vertices and " << destinations.size()
+       << " edges to " << argv[2] << endl;
+  return 0;
+}
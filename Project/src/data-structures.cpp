@@ -2,47 +2,403 @@
 // Purpose:
 #include "data-structures.h"
 
-const struct label EMPTY_LABEL = {(global_id)-1, -1, (local_id)-1, 0};
+#include <algorithm>
+
+const struct label EMPTY_LABEL = {(global_id)-1, -1, (local_id)-1, 0,
+                                  (unsigned int)-1, (global_id)-1};
+
+Graph::Graph() : ids(), out_offsets(1, 0), out_edges(), in_offsets(1, 0),
+                 in_edges() {}
+
+void Graph::reserve(size_t vertex_count, size_t edge_count) {
+  ids.reserve(vertex_count);
+  out_offsets.reserve(vertex_count + 1);
+  in_offsets.reserve(vertex_count + 1);
+  out_edges.reserve(edge_count);
+  in_edges.reserve(edge_count);
+}
+
+struct vertex Graph::operator[](local_id i) {
+  struct vertex v = {
+      ids[i],
+      EdgeRange<struct out_edge>(out_edges.data() + out_offsets[i],
+                                 out_edges.data() + out_offsets[i + 1]),
+      EdgeRange<struct in_edge>(in_edges.data() + in_offsets[i],
+                                in_edges.data() + in_offsets[i + 1]),
+  };
+  return v;
+}
+
+void Graph::add_vertex(global_id id) {
+  ids.push_back(id);
+  out_offsets.push_back(out_edges.size());
+  in_offsets.push_back(in_edges.size());
+}
+
+void Graph::push_out_edge(const struct out_edge &edge) {
+  out_edges.push_back(edge);
+  out_offsets.back() = out_edges.size();
+}
+
+void Graph::push_in_edge(const struct in_edge &edge) {
+  in_edges.push_back(edge);
+  in_offsets.back() = in_edges.size();
+}
+
+void Graph::assign_in_edges(std::vector<size_t> &offsets,
+                            std::vector<struct in_edge> &edges) {
+  in_offsets.swap(offsets);
+  in_edges.swap(edges);
+  offsets.clear();
+  edges.clear();
+}
+
+void Graph::compact(const std::vector<bool> &keep) {
+  local_id dest = 0;
+  size_t out_dest = 0;
+  size_t in_dest = 0;
+  for (local_id i = 0; i < ids.size(); ++i) {
+    if (!keep[i])
+      continue;
+    // shift this vertex's edges down over the removed ones
+    size_t out_begin = out_offsets[i];
+    size_t out_end = out_offsets[i + 1];
+    size_t in_begin = in_offsets[i];
+    size_t in_end = in_offsets[i + 1];
+    for (size_t j = out_begin; j < out_end; ++j)
+      out_edges[out_dest++] = out_edges[j];
+    for (size_t j = in_begin; j < in_end; ++j)
+      in_edges[in_dest++] = in_edges[j];
+    ids[dest] = ids[i];
+    // offsets[i + 1] has already been read, so overwriting is safe
+    out_offsets[dest + 1] = out_dest;
+    in_offsets[dest + 1] = in_dest;
+    ++dest;
+  }
+  ids.resize(dest);
+  out_offsets.resize(dest + 1);
+  in_offsets.resize(dest + 1);
+  out_edges.resize(out_dest);
+  in_edges.resize(in_dest);
+  // give the memory of the removed vertices back
+  std::vector<global_id>(ids).swap(ids);
+  std::vector<size_t>(out_offsets).swap(out_offsets);
+  std::vector<size_t>(in_offsets).swap(in_offsets);
+  std::vector<struct out_edge>(out_edges).swap(out_edges);
+  std::vector<struct in_edge>(in_edges).swap(in_edges);
+}
+
+EdgeRange<struct out_edge> Graph::all_out_edges() {
+  return EdgeRange<struct out_edge>(out_edges.data(),
+                                    out_edges.data() + out_edges.size());
+}
+
+EdgeRange<struct in_edge> Graph::all_in_edges() {
+  return EdgeRange<struct in_edge>(in_edges.data(),
+                                   in_edges.data() + in_edges.size());
+}
+
+/// Largest ratio of the ID range to the ID count for which GlobalIdMap uses a
+/// dense array
+#define DENSE_ID_RATIO 4
+
+GlobalIdMap::GlobalIdMap()
+    : dense(), min_id(0), keys(), values(), shift(64) {}
+
+void GlobalIdMap::assign(const std::vector<global_id> &ids, bool allow_dense) {
+  dense.clear();
+  keys.clear();
+  values.clear();
+  min_id = 0;
+  if (ids.empty())
+    return;
+
+  global_id max_id = *std::max_element(ids.begin(), ids.end());
+  min_id = *std::min_element(ids.begin(), ids.end());
+  if (allow_dense && max_id - min_id < DENSE_ID_RATIO * ids.size()) {
+    dense.assign(max_id - min_id + 1, (local_id)-1);
+    for (size_t i = 0; i < ids.size(); ++i) {
+      dense[ids[i] - min_id] = i;
+    }
+    return;
+  }
+
+  // keep the table at most half full
+  int bits = 1;
+  while (((size_t)1 << bits) < 2 * ids.size()) {
+    ++bits;
+  }
+  shift = 64 - bits;
+  keys.assign((size_t)1 << bits, (global_id)-1);
+  values.assign((size_t)1 << bits, (local_id)-1);
+  size_t mask = keys.size() - 1;
+  for (size_t i = 0; i < ids.size(); ++i) {
+    size_t slot = slot_of(ids[i]);
+    while (keys[slot] != (global_id)-1) {
+      slot = (slot + 1) & mask;
+    }
+    keys[slot] = ids[i];
+    values[slot] = i;
+  }
+}
+
+/// Maximum number of free chunks kept by each thread.
+#define CHUNK_POOL_LIMIT 256
+
+/**
+ * Per-thread free list of chunks. Threads both produce and consume edges, so
+ * chunks freed by a thread are usually reused by that same thread.
+ */
+struct ChunkPool {
+  QueueChunk *free_list;
+  size_t count;
+
+  ChunkPool() : free_list(NULL), count(0) {}
+  ~ChunkPool();
+};
+static thread_local ChunkPool chunk_pool;
+
+ChunkPool::~ChunkPool() {
+  while (free_list != NULL) {
+    QueueChunk *chunk = free_list;
+    free_list = chunk->next;
+    delete chunk;
+  }
+}
+
+QueueChunk *QueueChunk::acquire() {
+  QueueChunk *chunk = chunk_pool.free_list;
+  if (chunk != NULL) {
+    chunk_pool.free_list = chunk->next;
+    --chunk_pool.count;
+  } else {
+    chunk = new QueueChunk;
+  }
+  chunk->begin = chunk->end = 0;
+  chunk->next = NULL;
+  return chunk;
+}
+
+void QueueChunk::release(QueueChunk *chunk) {
+  if (chunk_pool.count >= CHUNK_POOL_LIMIT) {
+    delete chunk;
+    return;
+  }
+  chunk->next = chunk_pool.free_list;
+  chunk_pool.free_list = chunk;
+  ++chunk_pool.count;
+}
 
 EdgeQueue::EdgeQueue() {
-  auto *node = new QueueNode(); // Allocate a new node
-  node->next = NULL;            // Make it the only node in the linked list
-  head = tail = node;           // Both head and tail point to it
+  head = tail = QueueChunk::acquire(); // Start with a single empty chunk
 }
 
 EdgeQueue::~EdgeQueue() {
-  QueueNode *node = head;
-  // delete rest of queue
-  while (node != NULL) {
-    head = node->next;
-    delete node;
-    node = head;
+  QueueChunk *chunk = head;
+  // delete rest of queue. Don't use the pool here, since the global queue is
+  // destroyed after the main thread's pool.
+  while (chunk != NULL) {
+    head = chunk->next;
+    delete chunk;
+    chunk = head;
   }
 }
 
-void EdgeQueue::push(const struct edge_entry &value) {
-  auto *node = new QueueNode(value); // Allocate a new node
-  tail->next = node;                 // Link node at the end of the linked list
-  tail = node;                       // Swing tail to node
+void EdgeQueue::append(const struct edge_entry *values, size_t count) {
+  while (count > 0) {
+    size_t end = tail->end;
+    if (end == EDGE_QUEUE_CHUNK_SIZE) {
+      // tail chunk is full, link a new one after it
+      QueueChunk *chunk = QueueChunk::acquire();
+      __atomic_store_n(&tail->next, chunk, __ATOMIC_RELEASE);
+      tail = chunk;
+      end = 0;
+    }
+    size_t n = std::min(count, (size_t)EDGE_QUEUE_CHUNK_SIZE - end);
+    std::copy(values, values + n, tail->values + end);
+    // publish the new entries to pop()
+    __atomic_store_n(&tail->end, end + n, __ATOMIC_RELEASE);
+    values += n;
+    count -= n;
+  }
 }
 
+void EdgeQueue::push(const struct edge_entry &value) { append(&value, 1); }
+
 void EdgeQueue::merge_into(EdgeQueue &dest) {
-  if (head->next != NULL) {
-    dest.tail->next = head->next;
-    dest.tail = tail;
+  for (QueueChunk *chunk = head; chunk != NULL; chunk = chunk->next) {
+    dest.append(chunk->values + chunk->begin, chunk->end - chunk->begin);
   }
+  // keep the first chunk, so this queue is ready to be reused
+  QueueChunk *chunk = head->next;
+  while (chunk != NULL) {
+    QueueChunk *next = chunk->next;
+    QueueChunk::release(chunk);
+    chunk = next;
+  }
+  head->begin = head->end = 0;
   head->next = NULL;
   tail = head;
 }
 
 bool EdgeQueue::pop(struct edge_entry &entry) {
-  QueueNode *node = head;           // Read head
-  QueueNode *new_head = node->next; // Read next pointer
-  if (new_head == NULL) {           // Is queue empty?
-    return false;                   // Queue was empty
-  }
-  entry = new_head->value; // Queue not empty. Read value before release
-  head = new_head;         // Swing head to next node
-  delete node;             // Free node
-  return true;             // Queue was not empty, dequeue succeeded
+  while (true) {
+    QueueChunk *chunk = head;
+    if (chunk->begin < __atomic_load_n(&chunk->end, __ATOMIC_ACQUIRE)) {
+      entry = chunk->values[chunk->begin++]; // Read value from front of chunk
+      return true;                           // Dequeue succeeded
+    }
+    QueueChunk *next = __atomic_load_n(&chunk->next, __ATOMIC_ACQUIRE);
+    if (next == NULL) { // Is queue empty?
+      return false;     // Queue was empty
+    }
+    // entries may have been added before the next chunk was linked
+    if (chunk->begin < __atomic_load_n(&chunk->end, __ATOMIC_ACQUIRE)) {
+      continue;
+    }
+    head = next;                // Swing head to next chunk
+    QueueChunk::release(chunk); // Recycle the empty chunk
+  }
+}
+
+/// Initial number of entries in a WorkStealingDeque
+#define DEQUE_INITIAL_CAPACITY 256
+
+WorkStealingDeque::Buffer::Buffer(long capacity, Buffer *prev)
+    : capacity(capacity), values(new struct edge_entry[capacity]),
+      prev(prev) {}
+
+WorkStealingDeque::Buffer::~Buffer() { delete[] values; }
+
+WorkStealingDeque::WorkStealingDeque()
+    : top(0), bottom(0), buffer(new Buffer(DEQUE_INITIAL_CAPACITY, NULL)) {}
+
+WorkStealingDeque::~WorkStealingDeque() {
+  while (buffer != NULL) {
+    Buffer *prev = buffer->prev;
+    delete buffer;
+    buffer = prev;
+  }
+}
+
+void WorkStealingDeque::push(const struct edge_entry &value) {
+  long b = __atomic_load_n(&bottom, __ATOMIC_RELAXED);
+  long t = __atomic_load_n(&top, __ATOMIC_ACQUIRE);
+  Buffer *buf = __atomic_load_n(&buffer, __ATOMIC_RELAXED);
+  if (b - t > buf->capacity - 1) {
+    // full, so copy everything into a buffer twice as large
+    auto *bigger = new Buffer(buf->capacity * 2, buf);
+    for (long i = t; i < b; ++i) {
+      bigger->at(i) = buf->at(i);
+    }
+    __atomic_store_n(&buffer, bigger, __ATOMIC_RELEASE);
+    buf = bigger;
+  }
+  buf->at(b) = value;
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&bottom, b + 1, __ATOMIC_RELAXED);
+}
+
+bool WorkStealingDeque::pop(struct edge_entry &entry) {
+  long b = __atomic_load_n(&bottom, __ATOMIC_RELAXED) - 1;
+  Buffer *buf = __atomic_load_n(&buffer, __ATOMIC_RELAXED);
+  __atomic_store_n(&bottom, b, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  long t = __atomic_load_n(&top, __ATOMIC_RELAXED);
+  if (t > b) {
+    // deque was empty
+    __atomic_store_n(&bottom, b + 1, __ATOMIC_RELAXED);
+    return false;
+  }
+  entry = buf->at(b);
+  if (t == b) {
+    // last entry, so race against thieves for it
+    bool won = __atomic_compare_exchange_n(&top, &t, t + 1, false,
+                                           __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+    __atomic_store_n(&bottom, b + 1, __ATOMIC_RELAXED);
+    return won;
+  }
+  return true;
+}
+
+bool WorkStealingDeque::steal(struct edge_entry &entry) {
+  long t = __atomic_load_n(&top, __ATOMIC_ACQUIRE);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  long b = __atomic_load_n(&bottom, __ATOMIC_ACQUIRE);
+  if (t >= b) {
+    return false; // deque was empty
+  }
+  Buffer *buf = __atomic_load_n(&buffer, __ATOMIC_ACQUIRE);
+  struct edge_entry value = buf->at(t);
+  if (!__atomic_compare_exchange_n(&top, &t, t + 1, false, __ATOMIC_SEQ_CST,
+                                   __ATOMIC_RELAXED)) {
+    return false; // lost the race to the owner or another thief
+  }
+  entry = value;
+  return true;
+}
+
+void WorkStealingDeque::take_all(std::vector<struct edge_entry> &out) {
+  for (long i = top; i < bottom; ++i) {
+    out.push_back(buffer->at(i));
+  }
+  top = bottom;
+}
+
+void WorkStealingDeque::clear() { top = bottom; }
+
+bool EdgeHeap::narrower(const struct heap_entry &a,
+                        const struct heap_entry &b) {
+  return a.key < b.key;
+}
+
+EdgeHeap::EdgeHeap() : lock(), entries(), top_key(0) {}
+
+void EdgeHeap::push(const struct edge_entry &value, int key) {
+  ScopedLock l(lock);
+  struct heap_entry e = {key, value};
+  entries.push_back(e);
+  std::push_heap(entries.begin(), entries.end(), narrower);
+  __atomic_store_n(&top_key, entries.front().key, __ATOMIC_RELAXED);
+}
+
+bool EdgeHeap::take_top(struct edge_entry &entry) {
+  if (entries.empty()) {
+    return false;
+  }
+  std::pop_heap(entries.begin(), entries.end(), narrower);
+  entry = entries.back().edge;
+  entries.pop_back();
+  __atomic_store_n(&top_key, entries.empty() ? 0 : entries.front().key,
+                   __ATOMIC_RELAXED);
+  return true;
+}
+
+bool EdgeHeap::pop(struct edge_entry &entry) {
+  if (peek_key() == 0) {
+    return false;
+  }
+  ScopedLock l(lock);
+  return take_top(entry);
+}
+
+bool EdgeHeap::try_pop(struct edge_entry &entry) {
+  if (peek_key() == 0 || !lock.try_lock()) {
+    return false;
+  }
+  bool found = take_top(entry);
+  lock.unlock();
+  return found;
+}
+
+void EdgeHeap::take_all(std::vector<struct edge_entry> &out) {
+  for (size_t i = 0; i < entries.size(); ++i) {
+    out.push_back(entries[i].edge);
+  }
+  clear();
+}
+
+void EdgeHeap::clear() {
+  entries.clear();
+  top_key = 0;
 }
@@ -21,11 +21,15 @@ typedef size_t local_id;
  *
  * Otherwise, the "from" node is on another MPI rank, and @a dest_node_id is its
  * global ID.
+ *
+ * In both cases, @a out_index is the index of the matching edge in the "from"
+ * node's @c out_edges list, which holds the flow.
  */
 struct in_edge {
   global_id dest_node_id;
   int rank_location;
   local_id vert_index;
+  unsigned int out_index;
 };
 
 /**
@@ -51,15 +55,165 @@ struct label {
   int prev_rank_loc;
   local_id prev_vert_index;
   int value;
+  /// Index of the edge we came through in the @c out_edges list of its "from"
+  /// node, which is the previous node if @a value is positive, or this node if
+  /// it is negative.
+  unsigned int prev_edge_index;
+  /// The first node after the source on the path to this node, which says
+  /// which subtree of the search tree this node is in
+  global_id branch;
 };
 extern const struct label EMPTY_LABEL;
 
+/**
+ * A contiguous slice of one of the flat edge arrays in a Graph.
+ *
+ * Supports the subset of the std::vector interface used by the algorithm, so
+ * a vertex's edge list can be indexed and iterated like before.
+ */
+template <typename T> class EdgeRange {
+private:
+  T *first;
+  T *last;
+
+public:
+  EdgeRange(T *first, T *last) : first(first), last(last) {}
+
+  T *begin() const { return first; }
+  T *end() const { return last; }
+  T *data() const { return first; }
+  size_t size() const { return last - first; }
+  T &operator[](size_t i) const { return first[i]; }
+};
+
+/**
+ * View of a single vertex in a Graph. Only valid until the next vertex or edge
+ * is added to the graph.
+ */
 struct vertex {
   global_id id; // Should match index
 
   // Lists of the edges, which are pairs of capacities and vertex IDs
+  EdgeRange<struct out_edge> out_edges;
+  EdgeRange<struct in_edge> in_edges;
+};
+
+/**
+ * The local vertices and their edges, in compressed sparse row (CSR) form.
+ *
+ * The out-edges of local vertex @c i are stored in
+ * <tt>out_edges[out_offsets[i]:out_offsets[i + 1]]</tt>, and likewise for the
+ * in-edges, so every rank only holds a handful of large allocations no matter
+ * how many vertices it owns.
+ *
+ * Vertices can only be appended. Edges added with push_out_edge() and
+ * push_in_edge() belong to the most recently added vertex.
+ */
+class Graph {
+private:
+  std::vector<global_id> ids;
+  std::vector<size_t> out_offsets;
   std::vector<struct out_edge> out_edges;
+  std::vector<size_t> in_offsets;
   std::vector<struct in_edge> in_edges;
+
+public:
+  Graph();
+
+  /// Preallocate space for the given number of vertices and edges.
+  void reserve(size_t vertex_count, size_t edge_count);
+
+  local_id size() const { return ids.size(); }
+  struct vertex operator[](local_id i);
+
+  /// Append a new vertex with no edges.
+  void add_vertex(global_id id);
+  /// Append an out-edge to the last vertex.
+  void push_out_edge(const struct out_edge &edge);
+  /// Append an in-edge to the last vertex.
+  void push_in_edge(const struct in_edge &edge);
+  /**
+   * Replace the in-edges of every vertex at once. @p offsets must have one
+   * more entry than there are vertices. Both arguments are left empty.
+   */
+  void assign_in_edges(std::vector<size_t> &offsets,
+                       std::vector<struct in_edge> &edges);
+
+  /**
+   * Remove every vertex @c i for which @c keep[i] is false, preserving the
+   * order of the remaining vertices and their edges.
+   */
+  void compact(const std::vector<bool> &keep);
+
+  /// Position of the first out-edge of vertex @p i in all_out_edges().
+  size_t out_edge_offset(local_id i) const { return out_offsets[i]; }
+  /// Position of the first in-edge of vertex @p i in all_in_edges().
+  size_t in_edge_offset(local_id i) const { return in_offsets[i]; }
+
+  /// All out-edges in the graph, ordered by source vertex.
+  EdgeRange<struct out_edge> all_out_edges();
+  /// All in-edges in the graph, ordered by destination vertex.
+  EdgeRange<struct in_edge> all_in_edges();
+};
+
+/**
+ * Maps the global IDs of the local vertices to their local IDs.
+ *
+ * If the IDs are compact enough, the local ID of each is stored in a dense
+ * array indexed by the global ID. Otherwise, an open-addressing hash table
+ * with linear probing is used, which keeps every probe sequence within a
+ * cache line or two.
+ */
+class GlobalIdMap {
+private:
+  /// Dense mode: local ID of each global ID in [min_id, min_id + size), or
+  /// (local_id)-1 if it isn't local
+  std::vector<local_id> dense;
+  global_id min_id;
+  /// Hash mode: slots of the hash table, with empty slots holding
+  /// (global_id)-1 as the key
+  std::vector<global_id> keys;
+  std::vector<local_id> values;
+  /// Number of bits to shift the hash right by, to get a slot index
+  int shift;
+
+  size_t slot_of(global_id id) const {
+    // Fibonacci hashing, so consecutive or strided IDs spread out evenly
+    return (id * 0x9E3779B97F4A7C15ULL) >> shift;
+  }
+
+public:
+  GlobalIdMap();
+
+  /**
+   * Rebuild the map so that @c ids[i] maps to @c i.
+   *
+   * @param allow_dense Whether a dense array may be used, if the IDs are
+   *                    compact enough
+   */
+  void assign(const std::vector<global_id> &ids, bool allow_dense = true);
+
+  /// Whether the map uses a dense array instead of a hash table.
+  bool is_dense() const { return keys.empty(); }
+
+  /**
+   * Find the local ID of @p id.
+   *
+   * @return The local ID, or @c (local_id)-1 if @p id isn't in the map
+   */
+  local_id find(global_id id) const {
+    if (is_dense()) {
+      global_id offset = id - min_id;
+      return offset < dense.size() ? dense[offset] : (local_id)-1;
+    }
+    size_t mask = keys.size() - 1;
+    for (size_t slot = slot_of(id);; slot = (slot + 1) & mask) {
+      if (keys[slot] == id)
+        return values[slot];
+      if (keys[slot] == (global_id)-1)
+        return -1;
+    }
+  }
 };
 
 struct edge_entry {
@@ -67,21 +221,36 @@ struct edge_entry {
   local_id vertex_index;
   /// Whether the corresponding edge is in `out_edges` or `in_edges`
   bool is_outgoing;
+  /// Whether the edge was queued by the search from the sink, rather than the
+  /// search from the source
+  bool reverse_search;
   /// The index of the edge in its edge list
   unsigned int edge_index;
 };
 
+/// Number of entries held by each QueueChunk.
+#define EDGE_QUEUE_CHUNK_SIZE 64
+
 class EdgeQueue;
 
-class QueueNode {
+/**
+ * A fixed-size block of queue entries. Entries in <tt>[begin, end)</tt> are
+ * ready to be popped; @a end is only advanced after the entries below it have
+ * been written, so the consumer never sees a half-written entry.
+ */
+class QueueChunk {
   friend class EdgeQueue;
+  friend struct ChunkPool;
 
-  const struct edge_entry value;
-  QueueNode *next;
+  struct edge_entry values[EDGE_QUEUE_CHUNK_SIZE];
+  size_t begin;
+  size_t end;
+  QueueChunk *next;
 
-  QueueNode() : value(), next(NULL) {}
-  explicit QueueNode(const struct edge_entry &value)
-      : value(value), next(NULL) {}
+  /// Take a chunk from the calling thread's pool, or allocate a new one.
+  static QueueChunk *acquire();
+  /// Return a chunk to the calling thread's pool.
+  static void release(QueueChunk *chunk);
 };
 
 /**
@@ -91,18 +260,31 @@ class QueueNode {
  * Head locking is moved out of the pop function and into the main edge-
  * processing loop, so a single thread can spin without having to contend with
  * other threads for the lock.
+ *
+ * Instead of one heap node per entry, entries are stored in a linked list of
+ * QueueChunks which are recycled through a per-thread pool, so pushing and
+ * popping normally don't touch the allocator at all.
  */
 class EdgeQueue {
-public:
 private:
-  QueueNode *head;
-  QueueNode *tail;
+  QueueChunk *head;
+  QueueChunk *tail;
+
+  /**
+   * Copy @p count entries to the end of the queue, linking in new chunks as
+   * needed. May run concurrently with pop(), but not with itself.
+   */
+  void append(const struct edge_entry *values, size_t count);
 
 public:
   EdgeQueue();
   ~EdgeQueue();
 
   void push(const struct edge_entry &value);
+  /**
+   * Move all entries from this queue to the end of @p dest, leaving this queue
+   * empty. Only one thread may merge into @p dest at a time.
+   */
   void merge_into(EdgeQueue &dest);
 
   /**
@@ -116,4 +298,143 @@ public:
   bool pop(struct edge_entry &entry);
 };
 
+/**
+ * Work-stealing deque, based on the lock-free deque introduced by Chase and Lev
+ * in https://dl.acm.org/citation.cfm?id=1073974, using the memory orderings
+ * from Le et al. in https://dl.acm.org/citation.cfm?id=2442524.
+ *
+ * The owning thread pushes and pops at the bottom, while any other thread may
+ * steal from the top. The buffer grows as needed; old buffers are kept until
+ * the deque is destroyed, since a slow thief may still be reading from one.
+ */
+class WorkStealingDeque {
+private:
+  struct Buffer {
+    /// Always a power of two
+    long capacity;
+    struct edge_entry *values;
+    /// The buffer this one replaced, if any
+    Buffer *prev;
+
+    Buffer(long capacity, Buffer *prev);
+    ~Buffer();
+    struct edge_entry &at(long i) { return values[i & (capacity - 1)]; }
+  };
+
+  long top;
+  long bottom;
+  Buffer *buffer;
+
+  // not copyable
+  WorkStealingDeque(const WorkStealingDeque &);
+  WorkStealingDeque &operator=(const WorkStealingDeque &);
+
+public:
+  WorkStealingDeque();
+  ~WorkStealingDeque();
+
+  /// Add an entry to the bottom of the deque. Only called by the owner.
+  void push(const struct edge_entry &value);
+
+  /**
+   * Try to remove an entry from the bottom of the deque and store it in
+   * @p entry. Only called by the owner.
+   *
+   * @return @c true if an entry was retrieved, @c false if the deque is empty
+   */
+  bool pop(struct edge_entry &entry);
+
+  /**
+   * Try to remove an entry from the top of the deque and store it in
+   * @p entry. May be called by any thread.
+   *
+   * @return @c true if an entry was retrieved, @c false if the deque is empty
+   *         or another thread took the entry first
+   */
+  bool steal(struct edge_entry &entry);
+
+  /// Number of entries. Not to be called concurrently with other functions.
+  size_t size() const { return bottom - top; }
+
+  /**
+   * Remove all entries, and add them to the end of @p out. Must not be called
+   * concurrently with any other function.
+   */
+  void take_all(std::vector<struct edge_entry> &out);
+
+  /**
+   * Remove all entries. Must not be called concurrently with any other
+   * function.
+   */
+  void clear();
+};
+
+/**
+ * Max-heap of edges, keyed on the bottleneck capacity of the path each edge
+ * would extend, or on how close to the sink it leads. Each thread pushes to its
+ * own heap, but any thread may take the widest entry, so a set of them works
+ * as a relaxed concurrent priority queue, like the MultiQueues of Rihani et al.
+ * in https://dl.acm.org/citation.cfm?id=2755573.
+ */
+class EdgeHeap {
+private:
+  struct heap_entry {
+    int key;
+    struct edge_entry edge;
+  };
+
+  Mutex lock;
+  std::vector<struct heap_entry> entries;
+  /// Key of the widest entry, or 0 if the heap is empty
+  int top_key;
+
+  /// Orders heap entries so the widest one is at the front.
+  static bool narrower(const struct heap_entry &a, const struct heap_entry &b);
+  /// Removes the widest entry. @c lock must be held.
+  bool take_top(struct edge_entry &entry);
+
+  // not copyable
+  EdgeHeap(const EdgeHeap &);
+  EdgeHeap &operator=(const EdgeHeap &);
+
+public:
+  EdgeHeap();
+
+  void push(const struct edge_entry &value, int key);
+
+  /**
+   * Returns the key of the widest entry, or 0 if the heap is empty. Doesn't
+   * lock, so the entry may be gone by the time it is popped.
+   */
+  int peek_key() const { return __atomic_load_n(&top_key, __ATOMIC_RELAXED); }
+
+  /**
+   * Try to remove the widest entry and store it in @p entry.
+   *
+   * @return @c true if an entry was retrieved, @c false if the heap is empty
+   */
+  bool pop(struct edge_entry &entry);
+
+  /**
+   * Like pop(), but gives up instead of waiting if another thread is using
+   * the heap.
+   */
+  bool try_pop(struct edge_entry &entry);
+
+  /// Number of entries. Not to be called concurrently with other functions.
+  size_t size() const { return entries.size(); }
+
+  /**
+   * Remove all entries, and add them to the end of @p out. Must not be called
+   * concurrently with any other function.
+   */
+  void take_all(std::vector<struct edge_entry> &out);
+
+  /**
+   * Remove all entries. Must not be called concurrently with any other
+   * function.
+   */
+  void clear();
+};
+
 #endif // PARALLEL_PROJECT_DATA_STRUCTURES_H
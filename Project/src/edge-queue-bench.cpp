@@ -0,0 +1,196 @@
+/* Parallel Computing Project S2019
+ * Eric Johnson, Chris Jones, Harrison Lee
+ *
+ * Microbenchmark for EdgeQueue. Compares the chunked, pooled queue against the
+ * original one-node-per-entry linked queue, using the same access pattern as
+ * the edge-processing loop: each thread pops an edge under the head lock, then
+ * builds a fragment of new edges and merges it in under the tail lock.
+ *
+ * Usage: ./edge-queue-bench.out [total_edges] [degree] [thread_counts...]
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include <mpi.h>
+
+#include "data-structures.h"
+#include "pthread-wrappers.h"
+
+using namespace std;
+
+/**
+ * The original EdgeQueue, which allocates a node for every entry.
+ */
+class NodeEdgeQueue {
+private:
+  struct Node {
+    const struct edge_entry value;
+    Node *next;
+
+    Node() : value(), next(NULL) {}
+    explicit Node(const struct edge_entry &value) : value(value), next(NULL) {}
+  };
+
+  Node *head;
+  Node *tail;
+
+public:
+  NodeEdgeQueue() { head = tail = new Node(); }
+  ~NodeEdgeQueue() {
+    while (head != NULL) {
+      Node *node = head;
+      head = node->next;
+      delete node;
+    }
+  }
+
+  void push(const struct edge_entry &value) {
+    auto *node = new Node(value);
+    tail->next = node;
+    tail = node;
+  }
+
+  void merge_into(NodeEdgeQueue &dest) {
+    if (head->next != NULL) {
+      dest.tail->next = head->next;
+      dest.tail = tail;
+    }
+    head->next = NULL;
+    tail = head;
+  }
+
+  bool pop(struct edge_entry &entry) {
+    Node *node = head;
+    Node *new_head = node->next;
+    if (new_head == NULL) {
+      return false;
+    }
+    entry = new_head->value;
+    head = new_head;
+    delete node;
+    return true;
+  }
+};
+
+template <typename Queue> struct bench_state {
+  Queue queue;
+  Mutex h_lock;
+  Mutex t_lock;
+  /// Number of edges left to generate
+  long remaining;
+  /// Number of edges that have been pushed but not popped yet
+  long outstanding;
+  /// Sum of all popped vertex indices, to check that nothing was lost or
+  /// popped twice
+  unsigned long long checksum;
+  unsigned int degree;
+};
+
+template <typename Queue> void *bench_thread(bench_state<Queue> *state) {
+  Queue fragment;
+  struct edge_entry entry = {0, true, false, 0};
+  unsigned long long checksum = 0;
+  while (true) {
+    bool got_entry;
+    {
+      ScopedLock l(state->h_lock);
+      got_entry = state->queue.pop(entry);
+    }
+    if (!got_entry) {
+      if (__sync_fetch_and_add(&state->outstanding, 0) == 0)
+        break; // nothing queued and nothing left to generate
+      continue;
+    }
+    checksum += entry.vertex_index;
+
+    // "label" the node, and queue up its edges. Every generated entry gets a
+    // unique index in [1, total_edges), so the final checksum is fixed.
+    long count = __sync_fetch_and_sub(&state->remaining, state->degree);
+    if (count > 0) {
+      unsigned int n = count < (long)state->degree ? count : state->degree;
+      for (unsigned int i = 0; i < n; ++i) {
+        struct edge_entry temp = {(local_id)(count - i), true, false, i};
+        fragment.push(temp);
+      }
+      __sync_fetch_and_add(&state->outstanding, n);
+      state->t_lock.lock();
+      fragment.merge_into(state->queue);
+      state->t_lock.unlock();
+    }
+    __sync_fetch_and_sub(&state->outstanding, 1);
+  }
+  __sync_fetch_and_add(&state->checksum, checksum);
+  return NULL;
+}
+
+/**
+ * Runs the benchmark with @p num_threads threads, and returns the elapsed time
+ * in seconds. @p checksum is set to the sum of all popped vertex indices.
+ */
+template <typename Queue>
+double run_bench(long total_edges, unsigned int degree, size_t num_threads,
+                 unsigned long long &checksum) {
+  bench_state<Queue> state;
+  state.remaining = total_edges - 1;
+  state.outstanding = 1;
+  state.checksum = 0;
+  state.degree = degree;
+  struct edge_entry seed = {0, true, false, 0};
+  state.queue.push(seed);
+
+  vector<pthread_t> threads(num_threads);
+  double start = MPI_Wtime();
+  for (size_t i = 0; i < num_threads; ++i) {
+    pthread_create(&threads[i], NULL, (void *(*)(void *))bench_thread<Queue>,
+                   (void *)&state);
+  }
+  for (size_t i = 0; i < num_threads; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  double elapsed = MPI_Wtime() - start;
+  checksum = state.checksum;
+  return elapsed;
+}
+
+int main(int argc, char **argv) {
+  MPI_Init(&argc, &argv);
+
+  long total_edges = argc > 1 ? atol(argv[1]) : 4000000;
+  unsigned int degree = argc > 2 ? atoi(argv[2]) : 4;
+  vector<size_t> thread_counts;
+  for (int i = 3; i < argc; ++i) {
+    thread_counts.push_back(atoi(argv[i]));
+  }
+  if (thread_counts.empty()) {
+    thread_counts.push_back(1);
+    thread_counts.push_back(8);
+    thread_counts.push_back(64);
+  }
+
+  printf("edges=%ld, degree=%u\n", total_edges, degree);
+  printf("%8s %15s %15s %8s\n", "threads", "node (Medge/s)",
+         "chunk (Medge/s)", "speedup");
+  int status = 0;
+  unsigned long long expected = total_edges * (total_edges - 1) / 2;
+  for (size_t i = 0; i < thread_counts.size(); ++i) {
+    unsigned long long node_sum = 0;
+    unsigned long long chunk_sum = 0;
+    double node_time = run_bench<NodeEdgeQueue>(total_edges, degree,
+                                                thread_counts[i], node_sum);
+    double chunk_time = run_bench<EdgeQueue>(total_edges, degree,
+                                             thread_counts[i], chunk_sum);
+    printf("%8lu %15.2f %15.2f %7.2fx\n", thread_counts[i],
+           total_edges / node_time / 1e6, total_edges / chunk_time / 1e6,
+           node_time / chunk_time);
+    if (node_sum != expected || chunk_sum != expected) {
+      printf("ERROR: checksum mismatch (node %llu, chunk %llu, expected %llu)\n",
+             node_sum, chunk_sum, expected);
+      status = 1;
+    }
+  }
+
+  MPI_Finalize();
+  return status;
+}
@@ -0,0 +1,124 @@
+// File:    graph-file.cpp
+// Purpose: Binary compressed sparse row (CSR) graph files
+#include "graph-file.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <fstream>
+
+const char CSR_FILE_MAGIC[8] = {'F', 'L', 'O', 'W', 'C', 'S', 'R', '\0'};
+
+/// Rounds @p size up to a multiple of 8 bytes.
+static size_t align8(size_t size) { return (size + 7) & ~(size_t)7; }
+
+struct csr_file_layout csr_layout(const struct csr_file_header &header) {
+  struct csr_file_layout layout;
+  layout.offsets = sizeof(struct csr_file_header);
+  layout.destinations =
+      layout.offsets + (header.num_vertices + 1) * sizeof(uint64_t);
+  layout.capacities =
+      layout.destinations + header.num_edges * sizeof(uint64_t);
+  layout.total = align8(layout.capacities + header.num_edges * sizeof(int32_t));
+  return layout;
+}
+
+bool is_csr_file(const std::string &path) {
+  std::ifstream file(path.c_str(), std::ios::binary);
+  char magic[sizeof(CSR_FILE_MAGIC)];
+  if (!file.read(magic, sizeof(magic)))
+    return false;
+  return memcmp(magic, CSR_FILE_MAGIC, sizeof(magic)) == 0;
+}
+
+bool write_csr_file(const std::string &path,
+                    const std::vector<uint64_t> &offsets,
+                    const std::vector<uint64_t> &destinations,
+                    const std::vector<int32_t> &capacities) {
+  std::ofstream file(path.c_str(), std::ios::binary | std::ios::trunc);
+  if (!file)
+    return false;
+
+  struct csr_file_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, CSR_FILE_MAGIC, sizeof(header.magic));
+  header.version = CSR_FILE_VERSION;
+  header.num_vertices = offsets.size() - 1;
+  header.num_edges = destinations.size();
+  struct csr_file_layout layout = csr_layout(header);
+
+  file.write((const char *)&header, sizeof(header));
+  file.write((const char *)offsets.data(), offsets.size() * sizeof(uint64_t));
+  file.write((const char *)destinations.data(),
+             destinations.size() * sizeof(uint64_t));
+  file.write((const char *)capacities.data(),
+             capacities.size() * sizeof(int32_t));
+  // pad to the full size, so the file can be checked against its header
+  static const char padding[8] = {0};
+  file.write(padding, layout.total -
+                          (layout.capacities +
+                           capacities.size() * sizeof(int32_t)));
+  return (bool)file;
+}
+
+MappedGraphFile::MappedGraphFile() : data(MAP_FAILED), length(0), header() {}
+
+MappedGraphFile::~MappedGraphFile() {
+  if (data != MAP_FAILED) {
+    munmap(data, length);
+  }
+}
+
+bool MappedGraphFile::open(const std::string &path) {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd == -1)
+    return false;
+  struct stat st;
+  if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(header)) {
+    close(fd);
+    return false;
+  }
+  length = st.st_size;
+  data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+  // the mapping keeps the file open
+  close(fd);
+  if (data == MAP_FAILED)
+    return false;
+  // the arrays are read from front to back
+  madvise(data, length, MADV_SEQUENTIAL);
+
+  memcpy(&header, data, sizeof(header));
+  if (memcmp(header.magic, CSR_FILE_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != CSR_FILE_VERSION ||
+      csr_layout(header).total != length)
+    return false;
+  // the edge arrays must match the offsets
+  return offsets()[0] == 0 && offsets()[header.num_vertices] == edge_count();
+}
+
+const uint64_t *MappedGraphFile::offsets() const {
+  return (const uint64_t *)((const char *)data + csr_layout(header).offsets);
+}
+
+const uint64_t *MappedGraphFile::destinations() const {
+  return (const uint64_t *)((const char *)data +
+                            csr_layout(header).destinations);
+}
+
+const int32_t *MappedGraphFile::capacities() const {
+  return (const int32_t *)((const char *)data + csr_layout(header).capacities);
+}
+
+bool MappedGraphFile::offsets_valid(uint64_t first, uint64_t end) const {
+  if (first > end || end > header.num_vertices)
+    return false;
+  const uint64_t *offs = offsets();
+  for (uint64_t i = first; i < end; ++i) {
+    if (offs[i] > offs[i + 1])
+      return false;
+  }
+  return offs[end] <= header.num_edges;
+}
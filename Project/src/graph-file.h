@@ -0,0 +1,104 @@
+// File:    graph-file.h
+// Purpose: Binary compressed sparse row (CSR) graph files
+#ifndef PARALLEL_PROJECT_GRAPH_FILE_H
+#define PARALLEL_PROJECT_GRAPH_FILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * Layout of a binary graph file, which holds the same graph as an @c .adj file
+ * in CSR form. All values are in native byte order:
+ *
+ *  - a csr_file_header,
+ *  - <tt>uint64_t offsets[num_vertices + 1]</tt>, where the out-edges of
+ *    vertex @c i are <tt>[offsets[i], offsets[i + 1])</tt>,
+ *  - <tt>uint64_t destinations[num_edges]</tt>, the "to" node of each edge,
+ *  - <tt>int32_t capacities[num_edges]</tt>.
+ *
+ * Every array starts on an 8-byte boundary, so the file can be used in place
+ * once it is mapped into memory.
+ */
+struct csr_file_header {
+  /// Always CSR_FILE_MAGIC
+  char magic[8];
+  /// Always CSR_FILE_VERSION
+  uint64_t version;
+  uint64_t num_vertices;
+  uint64_t num_edges;
+};
+
+extern const char CSR_FILE_MAGIC[8];
+#define CSR_FILE_VERSION 1
+
+/// Byte offsets of each array in a binary graph file.
+struct csr_file_layout {
+  size_t offsets;
+  size_t destinations;
+  size_t capacities;
+  /// Size of the whole file
+  size_t total;
+};
+
+/// Returns where each array is in a file with the given header.
+struct csr_file_layout csr_layout(const struct csr_file_header &header);
+
+/// Returns @c true if the file at @p path starts with CSR_FILE_MAGIC.
+bool is_csr_file(const std::string &path);
+
+/**
+ * Writes a graph in CSR form to a binary graph file.
+ *
+ * @return @c true on success, @c false if the file couldn't be written
+ */
+bool write_csr_file(const std::string &path,
+                    const std::vector<uint64_t> &offsets,
+                    const std::vector<uint64_t> &destinations,
+                    const std::vector<int32_t> &capacities);
+
+/**
+ * Read-only memory mapping of a binary graph file. The arrays are read
+ * straight from the page cache, so loading a graph costs little more than
+ * paging it in.
+ */
+class MappedGraphFile {
+private:
+  void *data;
+  size_t length;
+  struct csr_file_header header;
+
+  // not copyable
+  MappedGraphFile(const MappedGraphFile &);
+  MappedGraphFile &operator=(const MappedGraphFile &);
+
+public:
+  MappedGraphFile();
+  ~MappedGraphFile();
+
+  /**
+   * Maps the file at @p path, and checks that its header and size are valid.
+   * Only the first and last offsets are checked, so callers must check the
+   * offsets of the vertices they read with offsets_valid().
+   *
+   * @return @c true on success, @c false if the file couldn't be mapped or is
+   *         not a valid graph file
+   */
+  bool open(const std::string &path);
+
+  uint64_t vertex_count() const { return header.num_vertices; }
+  uint64_t edge_count() const { return header.num_edges; }
+  const uint64_t *offsets() const;
+  const uint64_t *destinations() const;
+  const int32_t *capacities() const;
+
+  /**
+   * Checks that the offsets of vertices <tt>[first, end)</tt> never decrease
+   * and don't run past the end of the edge arrays, so their edges can be read
+   * safely.
+   */
+  bool offsets_valid(uint64_t first, uint64_t end) const;
+};
+
+#endif // PARALLEL_PROJECT_GRAPH_FILE_H
@@ -0,0 +1,159 @@
+/* Parallel Computing Project S2019
+ * Eric Johnson, Chris Jones, Harrison Lee
+ *
+ * Microbenchmark for GlobalIdMap. Compares the std::map used before against
+ * the hash table and dense array modes, looking up the receiving node of a
+ * stream of messages the way the message handlers do.
+ *
+ * Each partition gives one rank's share of the global IDs:
+ *  - block: a contiguous range, like the initial file blocks,
+ *  - cyclic: every p-th ID, so nearly every node is a border node,
+ *  - random: a random subset, like a graph partitioner produces for poorly
+ *    clustered graphs.
+ *
+ * Every structure is warmed up with one untimed pass, then timed over
+ * BENCH_ROUNDS interleaved rounds, with the order of the structures rotated
+ * each round, and the median time of each is reported. That keeps cache and
+ * clock state left over from one run from favouring the next, so two
+ * structures that end up in the same mode measure the same.
+ *
+ * Usage: ./id-map-bench.out [node_count] [rank_count] [lookup_count]
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <random>
+#include <vector>
+
+#include <mpi.h>
+
+#include "data-structures.h"
+
+using namespace std;
+
+/// Number of timed rounds for each structure
+#define BENCH_ROUNDS 7
+
+/**
+ * Looks up every ID in @p lookups in @p tree, and returns the elapsed time in
+ * seconds. @p checksum is set to the sum of the local IDs found.
+ */
+double time_lookups(const map<global_id, local_id> &tree,
+                    const vector<global_id> &lookups,
+                    unsigned long long &checksum) {
+  checksum = 0;
+  double start = MPI_Wtime();
+  for (size_t i = 0; i < lookups.size(); ++i) {
+    checksum += tree.find(lookups[i])->second;
+  }
+  return MPI_Wtime() - start;
+}
+
+/**
+ * Looks up every ID in @p lookups in @p id_map, and returns the elapsed time in
+ * seconds. @p checksum is set to the sum of the local IDs found.
+ *
+ * Not inlined, so every GlobalIdMap is timed by the same machine code.
+ */
+__attribute__((noinline)) double time_lookups(const GlobalIdMap &id_map,
+                                              const vector<global_id> &lookups,
+                                              unsigned long long &checksum) {
+  checksum = 0;
+  double start = MPI_Wtime();
+  for (size_t i = 0; i < lookups.size(); ++i) {
+    checksum += id_map.find(lookups[i]);
+  }
+  return MPI_Wtime() - start;
+}
+
+/// Returns the median of @p times.
+double median(vector<double> times) {
+  sort(times.begin(), times.end());
+  return times[times.size() / 2];
+}
+
+int main(int argc, char **argv) {
+  MPI_Init(&argc, &argv);
+
+  global_id node_count = argc > 1 ? atoll(argv[1]) : 2000000;
+  int rank_count = argc > 2 ? atoi(argv[2]) : 16;
+  size_t lookup_count = argc > 3 ? atol(argv[3]) : 20000000;
+  mt19937_64 rng(42);
+
+  printf("nodes=%llu, ranks=%d, lookups=%lu\n", node_count, rank_count,
+         lookup_count);
+  printf("%8s %10s %15s %15s %15s\n", "layout", "auto mode", "map (M/s)",
+         "hash (M/s)", "auto (M/s)");
+  const char *layouts[] = {"block", "cyclic", "random"};
+  int status = 0;
+  for (int layout = 0; layout < 3; ++layout) {
+    // the IDs held by rank 0
+    vector<global_id> ids;
+    for (global_id id = 0; id < node_count; ++id) {
+      bool local;
+      if (layout == 0) {
+        local = id < node_count / rank_count;
+      } else if (layout == 1) {
+        local = id % rank_count == 0;
+      } else {
+        local = rng() % rank_count == 0;
+      }
+      if (local) {
+        ids.push_back(id);
+      }
+    }
+    shuffle(ids.begin(), ids.end(), rng);
+    vector<global_id> lookups(lookup_count);
+    for (size_t i = 0; i < lookup_count; ++i) {
+      lookups[i] = ids[rng() % ids.size()];
+    }
+
+    map<global_id, local_id> tree;
+    for (local_id i = 0; i < ids.size(); ++i) {
+      tree[ids[i]] = i;
+    }
+    GlobalIdMap hash;
+    hash.assign(ids, false);
+    GlobalIdMap automatic;
+    automatic.assign(ids);
+
+    // 0 is the std::map, 1 the hash table, and 2 the automatic choice
+    const int num_structures = 3;
+    unsigned long long sums[num_structures];
+    vector<double> times[num_structures];
+    for (int round = -1; round < BENCH_ROUNDS; ++round) {
+      for (int k = 0; k < num_structures; ++k) {
+        int s = (k + max(round, 0)) % num_structures;
+        double elapsed;
+        if (s == 0) {
+          elapsed = time_lookups(tree, lookups, sums[s]);
+        } else {
+          elapsed = time_lookups(s == 1 ? hash : automatic, lookups, sums[s]);
+        }
+        if (round >= 0) { // round -1 is the warm-up
+          times[s].push_back(elapsed);
+        }
+      }
+    }
+    double tree_time = median(times[0]);
+    double hash_time = median(times[1]);
+    double auto_time = median(times[2]);
+    unsigned long long tree_sum = sums[0];
+    unsigned long long hash_sum = sums[1];
+    unsigned long long auto_sum = sums[2];
+    printf("%8s %10s %15.2f %15.2f %15.2f\n", layouts[layout],
+           automatic.is_dense() ? "dense" : "hash",
+           lookup_count / tree_time / 1e6, lookup_count / hash_time / 1e6,
+           lookup_count / auto_time / 1e6);
+    if (hash_sum != tree_sum || auto_sum != tree_sum) {
+      printf("ERROR: checksum mismatch (map %llu, hash %llu, auto %llu)\n",
+             tree_sum, hash_sum, auto_sum);
+      status = 1;
+    }
+  }
+
+  MPI_Finalize();
+  return status;
+}
@@ -3,18 +3,23 @@
  */
 
 #include <mpi.h>
+#include <sched.h>
 
+#include <algorithm>
+#include <climits>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <fstream>
 #include <iostream>
 #include <limits>
-#include <map>
 #include <sstream>
+#include <unordered_map>
 #include <vector>
 #include <zoltan.h>
 
 #include "data-structures.h"
+#include "graph-file.h"
 #include "pthread-wrappers.h"
 
 using namespace std;
@@ -74,6 +79,11 @@ int mpi_rank;
 int mpi_size;
 MPI_Datatype MPI_MESSAGE_TYPE;
 
+/// Maximum number of labelling messages sent to another rank at once
+#define LABEL_BATCH_SIZE 256
+/// Partially filled batches are sent after waiting this many seconds
+#define LABEL_FLUSH_INTERVAL 0.0005
+
 struct message_data {
   /// The ID of the node belonging to the sender
   global_id senders_node;
@@ -83,51 +93,54 @@ struct message_data {
   int value;
   /// The current pass number
   int pass;
+  /// Index of the relevant edge in the @c out_edges list of its "from" node,
+  /// or @c (unsigned int)-1 if there is none
+  unsigned int edge_index;
+  /// The @c branch of the sender's label, for labelling messages
+  global_id branch;
 };
 
 enum message_tags : int {
-  /// Set the label on a node, generated from an incoming edge
+  /// Set the label on a node. The value is negative if the label was
+  /// generated from an outgoing edge with flow, using its mirrored flow.
   SET_TO_LABEL = 1,
-  /// Compute and set the label on a node, generated from an outgoing edge
-  COMPUTE_FROM_LABEL,
-  /// Another rank found the sink node in step 2, move on to step 3. Pass on to
-  /// the next rank.
+  /// Set the sink label on a node, generated from an outgoing edge
+  SET_SINK_LABEL,
+  /// Compute and set the sink label on a node, generated from an incoming edge
+  COMPUTE_SINK_LABEL,
+  /// A rank found the sink node in step 2, move on to step 3. Holds the rank
+  /// that found it; pass it on with forward_sink_found().
   SINK_FOUND,
-  /// Used during step 3
+  /// Used during step 3. The value has the sign of the sender's label, so a
+  /// negative value means the receiver holds the edge's mirrored flow.
   UPDATE_FLOW,
-  /// Another rank found the source node in step 3; go back to step 1. Pass on
-  /// to the next rank.
-  SOURCE_FOUND,
+  /// Used during step 3, to push flow along the sink's half of a path found by
+  /// a bidirectional search. The value has the sign of the sender's sink label.
+  UPDATE_SINK_FLOW,
   /// Sent to rank 0 after the algorithm finishes, contains the flow through
   /// the graph
   TOTAL_FLOW,
-  /// Termination detection tokens
-  TOKEN_WHITE,
-  TOKEN_RED,
-  /// Sent to all ranks by rank 0; should start Allreduce over @c queue_is_empty
-  CHECK_TERMINATION,
 };
 
+/// Number of tags used for labelling batches, which are consecutive
+#define LABEL_TAG_COUNT (COMPUTE_SINK_LABEL - SET_TO_LABEL + 1)
+
 const char *tag2str(int tag) {
   switch (tag) {
   case SET_TO_LABEL:
     return "SET_TO_LABEL";
-  case COMPUTE_FROM_LABEL:
-    return "COMPUTE_FROM_LABEL";
+  case SET_SINK_LABEL:
+    return "SET_SINK_LABEL";
+  case COMPUTE_SINK_LABEL:
+    return "COMPUTE_SINK_LABEL";
   case SINK_FOUND:
     return "SINK_FOUND";
   case UPDATE_FLOW:
     return "UPDATE_FLOW";
-  case SOURCE_FOUND:
-    return "SOURCE_FOUND";
+  case UPDATE_SINK_FLOW:
+    return "UPDATE_SINK_FLOW";
   case TOTAL_FLOW:
     return "TOTAL_FLOW";
-  case TOKEN_WHITE:
-    return "TOKEN_WHITE";
-  case TOKEN_RED:
-    return "TOKEN_RED";
-  case CHECK_TERMINATION:
-    return "CHECK_TERMINATION";
   default:
     return "INVALID_TAG";
   }
@@ -156,41 +169,163 @@ float zoltan_version;
 /****************** Globals ********************/
 
 size_t num_threads = 64;
+
+/// The algorithms that can be used to compute the max flow
+enum max_flow_engine {
+  /// Repeatedly search for augmenting paths (the default)
+  ENGINE_FORD_FULKERSON,
+  /// Goldberg-Tarjan push-relabel
+  ENGINE_PUSH_RELABEL,
+  /// Dinic-style blocking flows on a level graph
+  ENGINE_DINIC,
+};
+enum max_flow_engine engine = ENGINE_FORD_FULKERSON;
+/// Whether the Ford-Fulkerson engine also searches backwards from the sink
+bool bidirectional_search = false;
+/// Whether the Ford-Fulkerson engine uses capacity scaling
+bool capacity_scaling = false;
+/// Whether the Ford-Fulkerson engine extends the widest paths first, instead
+/// of the most recently found ones
+bool widest_path = false;
+/// Whether step 2 of the Ford-Fulkerson engine runs one BFS level at a time,
+/// exchanging labelling messages in bulk between levels
+bool level_synchronous = false;
+/// Whether the Ford-Fulkerson engine takes the edges leading closest to the
+/// sink first, A*-style, using the estimates in @c sink_distance. Cleared by
+/// compute_sink_distances() if the estimates can't be computed cheaply.
+bool guided_search = false;
+/**
+ * Set by thread 0 between levels if the search from the source currently runs
+ * bottom-up on this rank: newly labelled nodes only queue their edges to other
+ * ranks, and the local nodes they lead to are found by bottom_up_sweep().
+ */
+bool bottom_up = false;
+/**
+ * Only residual edges with at least this much capacity are used by the
+ * Ford-Fulkerson engine. Always 1 without capacity scaling; otherwise it
+ * starts at the largest power of 2 not above any capacity, and is halved
+ * whenever no path is left.
+ */
+int scaling_delta = 1;
 global_id graph_node_count;
 
 // source and sink ids
 global_id source_id = -1;
 global_id sink_id = -1;
+/// The rank that owns the sink node, if @c bidirectional_search is set
+int sink_rank = -1;
 
-/// Number of threads currently doing work (not waiting for messages or edges)
-int working_threads;
-/// The current color of this rank
-enum message_tags my_color;
-/// Whether we currently have the token
-bool have_token;
-/// The color of the token, if we have it;
-enum message_tags token_color;
-/// Set if a worker thread has found the queue to be empty.
-bool queue_is_empty;
+/**
+ * Number of edges that have been queued but not fully processed yet, plus the
+ * number of labelling messages that have not been sent yet, plus the number of
+ * received batches and bottom-up sweep chunks that have not been handled yet.
+ * The rank is idle when this is zero.
+ */
+int pending_work;
 
 // entries in `vertices` and entries in `labels` must correspond one-to-one
-vector<struct vertex> vertices;
+Graph vertices;
 vector<struct label> labels;
-map<global_id, local_id> global_to_local;
-int *global_id_to_rank;
+/// Per thread: local nodes labelled by that thread this pass, so only they
+/// need to be reset before the next pass
+vector<vector<local_id>> labelled_nodes;
+/**
+ * Labels of the search tree grown backwards from the sink, if
+ * @c bidirectional_search is set. The @c prev_ fields point at the next node
+ * on the path to the sink. A positive value means the edge to that node is an
+ * out-edge of this node; a negative one means it is an in-edge with flow.
+ */
+vector<struct label> sink_labels;
+/// Per thread: local nodes given a sink label by that thread this pass
+vector<vector<local_id>> sink_labelled_nodes;
+/**
+ * For each in-edge from a node on another rank, this rank's copy of the edge's
+ * flow, indexed like @c vertices.all_in_edges(). It only changes in step 3,
+ * which keeps it up to date, so in-edges can be checked without asking the
+ * rank that holds the flow.
+ */
+vector<int> mirror_flow;
+/**
+ * The border slot of the node at the other end of each out-edge and in-edge,
+ * indexed like @c vertices.all_out_edges() and @c vertices.all_in_edges(), or
+ * @c (size_t)-1 if that node is local. Every node on another rank with an edge
+ * to a local node has a slot.
+ */
+vector<size_t> out_border_slot;
+vector<size_t> in_border_slot;
+/// Maps the global ID of each node with a border slot to the slot
+GlobalIdMap border_slots;
+/**
+ * For each border slot, the last pass in which this rank sent the node a
+ * label, or got one from it. Either way the node is labelled already, or will
+ * be once the message arrives, so there is no need to send it another one.
+ */
+vector<int> border_labelled_pass;
+/// The global ID and rank of the node in each border slot
+vector<global_id> border_ids;
+vector<int> border_slot_ranks;
+/**
+ * The edges between local nodes and the node in each border slot, as queue
+ * entries of the local node. The edges of slot @c s are
+ * <tt>border_edges[border_edge_offsets[s]:border_edge_offsets[s + 1]]</tt>.
+ */
+vector<size_t> border_edge_offsets;
+vector<struct edge_entry> border_edges;
+/// The distance of a node from which the sink can't be reached
+const int NO_SINK_DISTANCE = numeric_limits<int>::max() - 1;
+/**
+ * If @c guided_search is set, the number of residual edges on the shortest
+ * path from each local node to the sink, as of the last time they were
+ * computed, or NO_SINK_DISTANCE. Only used to order the edges, so it doesn't
+ * matter if it is out of date.
+ */
+vector<int> sink_distance;
+/// The same for the node in each border slot
+vector<int> border_sink_distance;
+/// Number of labelling messages sent, and left out by the border filter
+long label_messages_sent;
+long label_messages_filtered;
+GlobalIdMap global_to_local;
 /// Set to true when the sink node is found in step 2.
 bool sink_found = false;
 /// The thread that should perform step 3 sets this atomically.
 int step_3_tid = -1;
 /// The current algorithm iteration count
 int pass = 1;
+/// The rank that owns the source node
+int source_rank = -1;
+/// Set once this rank has been told that the sink was found this pass
+bool sink_found_received = false;
+/**
+ * An UPDATE_FLOW or UPDATE_SINK_FLOW message that arrived before this rank was
+ * told that the sink was found, to be handled in step 3; @c early_update_tag
+ * is 0 if there is none.
+ */
+struct message_data early_update;
+int early_update_tag = 0;
+
+/**
+ * Communicators for the control messages of even and odd passes. A rank that
+ * is still finishing step 3 may get messages from ranks that have started the
+ * next pass, and this keeps it from taking them.
+ */
+MPI_Comm control_comms[2];
+/// The communicator for control messages in the current pass
+MPI_Comm control_comm() { return control_comms[pass % 2]; }
+/// Control messages sent by send_control_message(), kept until they complete
+std::deque<struct message_data> control_messages;
+std::vector<MPI_Request> control_requests;
 
 /// Set to true when no valid paths can be found through the graph.
 bool algorithm_complete = false;
 
-EdgeQueue edge_queue;
-Mutex h_lock;
-Mutex t_lock;
+/// One work-stealing deque of edges per thread, indexed by thread ID
+WorkStealingDeque *edge_deques;
+/// One heap of edges per thread, used instead of @c edge_deques if
+/// @c widest_path or @c guided_search is set
+EdgeHeap *edge_heaps;
+/// Whether edges are kept in @c edge_heaps, ordered by their keys
+bool use_edge_heaps() { return widest_path || guided_search; }
 
 struct thread_params {
   int tid;
@@ -203,12 +338,780 @@ struct thread_params {
  * @param id The global ID to lookup
  * @return The local ID of the given node, or @c (local_id)-1 if not found.
  */
-local_id lookup_global_id(global_id id) {
-  auto search = global_to_local.find(id);
+local_id lookup_global_id(global_id id) { return global_to_local.find(id); }
 
-  if (search == global_to_local.end())
-    return -1;
-  return search->second;
+/*********** Communication Engine ***************/
+
+/// Number of receives kept posted for labelling batches
+#define RECV_SLOT_COUNT 16
+/// Maximum number of labelling batches being sent at once
+#define SEND_SLOT_COUNT 64
+/// Received batches are split into pieces of at most this many messages, so
+/// several workers can handle one batch at once
+#define RECEIVED_CHUNK_SIZE 32
+
+/**
+ * Communicator for labelling batches. Keeping them apart from the control
+ * messages lets us keep receives posted for them while thread 0 still probes
+ * for control messages.
+ */
+MPI_Comm label_comm;
+
+/**
+ * A fixed set of MPI requests, each with its own buffer. Requests that are not
+ * in use are MPI_REQUEST_NULL, so the whole array can be passed to
+ * MPI_Testsome.
+ */
+struct request_pool {
+  Mutex lock;
+  vector<MPI_Request> requests;
+  vector<vector<struct message_data>> buffers;
+  /// Indices of the requests that are not in use
+  vector<int> free_slots;
+};
+
+/// Outgoing batches. Shared by all threads, so @c lock must be held.
+struct request_pool send_pool;
+/// Posted receives. Polled by whichever thread holds @c lock, see
+/// progress_label_comm().
+struct request_pool recv_pool;
+
+/// A batch of labelling messages that has been received, but not handled yet,
+/// or a piece of one
+struct received_batch {
+  int tag;
+  int source;
+  vector<struct message_data> messages;
+};
+
+/// Received batches, waiting to be handled by a worker thread
+deque<struct received_batch> completion_queue;
+/// Batches from ranks that have already started the next pass, to be queued
+/// by reset_label_comm() once we start it too
+deque<struct received_batch> next_pass_batches;
+/// Empty buffers, to be reused for posted receives
+vector<vector<struct message_data>> spare_buffers;
+/// Protects @c completion_queue, @c next_pass_batches and @c spare_buffers
+Mutex completion_lock;
+/// The size of @c completion_queue, so idle workers can check it cheaply
+int completion_count;
+
+/// Number of batches sent and received during this pass
+int batches_sent;
+int batches_received;
+/// The total number of batches received by all ranks, as of the last
+/// termination check, or -1 if there hasn't been one yet this pass
+int checked_batches_received;
+
+/// Outcome of the termination detection rounds in a pass
+enum termination_result {
+  /// No round has decided yet
+  TERMINATION_UNKNOWN,
+  /// Every rank is idle and no batch is in flight
+  TERMINATION_DONE,
+  /// Some rank has stopped step 2 because the sink was found
+  TERMINATION_STOPPED,
+};
+
+/// Used only for the termination detection rounds
+MPI_Comm termination_comm;
+/// The round in progress, or @c MPI_REQUEST_NULL
+MPI_Request termination_request;
+/// This rank's and the summed counters of the round in progress
+int termination_local[4];
+int termination_total[4];
+/// The outcome of the rounds so far this pass
+enum termination_result termination_state;
+
+void post_label_recv(int slot) {
+  vector<struct message_data> &buffer = recv_pool.buffers[slot];
+  buffer.resize(LABEL_BATCH_SIZE);
+  MPI_Irecv(buffer.data(), LABEL_BATCH_SIZE, MPI_MESSAGE_TYPE, MPI_ANY_SOURCE,
+            MPI_ANY_TAG, label_comm, &recv_pool.requests[slot]);
+}
+
+/**
+ * Creates the label communicator and posts the initial receives. Called by
+ * every rank before the algorithm starts.
+ */
+void start_label_comm() {
+  MPI_Comm_dup(MPI_COMM_WORLD, &label_comm);
+  MPI_Comm_dup(MPI_COMM_WORLD, &termination_comm);
+  termination_request = MPI_REQUEST_NULL;
+  recv_pool.requests.assign(RECV_SLOT_COUNT, MPI_REQUEST_NULL);
+  recv_pool.buffers.resize(RECV_SLOT_COUNT);
+  for (int slot = 0; slot < RECV_SLOT_COUNT; ++slot) {
+    post_label_recv(slot);
+  }
+  send_pool.requests.assign(SEND_SLOT_COUNT, MPI_REQUEST_NULL);
+  send_pool.buffers.resize(SEND_SLOT_COUNT);
+  for (int slot = SEND_SLOT_COUNT - 1; slot >= 0; --slot) {
+    send_pool.free_slots.push_back(slot);
+  }
+}
+
+/**
+ * Returns the slots of completed sends to the free list. @c send_pool.lock
+ * must be held.
+ */
+void reap_sends() {
+  int count = 0;
+  int indices[SEND_SLOT_COUNT];
+  MPI_Testsome(SEND_SLOT_COUNT, send_pool.requests.data(), &count, indices,
+               MPI_STATUSES_IGNORE);
+  if (count == MPI_UNDEFINED) {
+    return; // nothing in flight
+  }
+  for (int i = 0; i < count; ++i) {
+    send_pool.buffers[indices[i]].clear();
+    send_pool.free_slots.push_back(indices[i]);
+  }
+}
+
+/**
+ * Splits a received batch into pieces in the completion queue, and counts it
+ * as received. @c completion_lock must be held.
+ */
+void queue_received_batch(struct received_batch &batch) {
+  int size = batch.messages.size();
+  int chunks = (size + RECEIVED_CHUNK_SIZE - 1) / RECEIVED_CHUNK_SIZE;
+  // count the pieces as work before the batch is counted as received, so the
+  // termination check can't see it as neither
+  __sync_fetch_and_add(&pending_work, chunks);
+  __sync_fetch_and_add(&batches_received, 1);
+  // copy out all but the first piece, which keeps the batch's buffer
+  for (int begin = RECEIVED_CHUNK_SIZE; begin < size;
+       begin += RECEIVED_CHUNK_SIZE) {
+    struct received_batch chunk;
+    chunk.tag = batch.tag;
+    chunk.source = batch.source;
+    if (!spare_buffers.empty()) {
+      chunk.messages.swap(spare_buffers.back());
+      spare_buffers.pop_back();
+    }
+    chunk.messages.assign(
+        batch.messages.begin() + begin,
+        batch.messages.begin() + min(begin + RECEIVED_CHUNK_SIZE, size));
+    completion_queue.push_back(std::move(chunk));
+  }
+  batch.messages.resize(min(size, RECEIVED_CHUNK_SIZE));
+  completion_queue.push_back(std::move(batch));
+  __sync_fetch_and_add(&completion_count, chunks);
+}
+
+/**
+ * Moves completed receives into the completion queue and reposts them, and
+ * frees the slots of completed sends. Called by thread 0 during step 2, and by
+ * worker threads when they run out of work, so reception isn't held up while
+ * thread 0 is busy or descheduled. Returns at once if another thread is
+ * already polling.
+ */
+void progress_label_comm(int tid) {
+  if (!recv_pool.lock.try_lock()) {
+    return;
+  }
+  int count = 0;
+  int indices[RECV_SLOT_COUNT];
+  MPI_Status statuses[RECV_SLOT_COUNT];
+  MPI_Testsome(RECV_SLOT_COUNT, recv_pool.requests.data(), &count, indices,
+               statuses);
+  for (int i = 0; i < count && count != MPI_UNDEFINED; ++i) {
+    int slot = indices[i];
+    vector<struct message_data> &buffer = recv_pool.buffers[slot];
+    int size = 0;
+    MPI_Get_count(&statuses[i], MPI_MESSAGE_TYPE, &size);
+    if (size > 0 && (buffer[0].pass == pass || buffer[0].pass == pass + 1)) {
+      struct received_batch batch;
+      batch.tag = statuses[i].MPI_TAG;
+      batch.source = statuses[i].MPI_SOURCE;
+      buffer.resize(size);
+      batch.messages.swap(buffer);
+      ScopedLock l(completion_lock);
+      if (batch.messages[0].pass == pass) {
+        DEBUG(2, "S2: got %d %s msgs from R%d", size, tag2str(batch.tag),
+              batch.source);
+        queue_received_batch(batch);
+      } else {
+        // the sender has already started the next pass
+        DEBUG(1, "S2: keeping %d %s msgs from R%d for the next pass", size,
+              tag2str(batch.tag), batch.source);
+        next_pass_batches.push_back(std::move(batch));
+      }
+      if (!spare_buffers.empty()) {
+        buffer.swap(spare_buffers.back());
+        spare_buffers.pop_back();
+      }
+    } else {
+      DEBUG(1, "S2: discarding %d old %s msgs from R%d", size,
+            tag2str(statuses[i].MPI_TAG), statuses[i].MPI_SOURCE);
+    }
+    post_label_recv(slot);
+  }
+  recv_pool.lock.unlock();
+  if (send_pool.lock.try_lock()) {
+    reap_sends();
+    send_pool.lock.unlock();
+  }
+}
+
+/**
+ * Takes the oldest batch from the completion queue, if there is one. Called by
+ * worker threads.
+ *
+ * @return @c true if a batch was retrieved, @c false if the queue is empty
+ */
+bool take_received_batch(struct received_batch &batch) {
+  if (__atomic_load_n(&completion_count, __ATOMIC_ACQUIRE) == 0) {
+    return false;
+  }
+  ScopedLock l(completion_lock);
+  if (completion_queue.empty()) {
+    return false;
+  }
+  batch = std::move(completion_queue.front());
+  completion_queue.pop_front();
+  __sync_fetch_and_sub(&completion_count, 1);
+  return true;
+}
+
+/// Gives the buffer of a handled batch back to the receive path.
+void recycle_batch_buffer(vector<struct message_data> &buffer) {
+  buffer.clear();
+  ScopedLock l(completion_lock);
+  spare_buffers.push_back(vector<struct message_data>());
+  spare_buffers.back().swap(buffer);
+}
+
+/**
+ * Resets the per-pass state of the communication engine. Must not be called
+ * concurrently with any other function in this section.
+ */
+void reset_label_comm() {
+  while (!completion_queue.empty()) {
+    recycle_batch_buffer(completion_queue.front().messages);
+    completion_queue.pop_front();
+  }
+  completion_count = 0;
+  batches_sent = 0;
+  batches_received = 0;
+  checked_batches_received = -1;
+  termination_state = TERMINATION_UNKNOWN;
+  ScopedLock l(completion_lock);
+  while (!next_pass_batches.empty()) {
+    queue_received_batch(next_pass_batches.front());
+    next_pass_batches.pop_front();
+  }
+}
+
+/**
+ * Drives the termination detection rounds, without blocking. Each round is an
+ * MPI_Iallreduce over whether each rank is busy, whether it has stopped step
+ * 2, and its batch counters, so its result reaches every rank after
+ * O(log mpi_size) steps. A rank only joins the next round once it is idle or
+ * has stopped, so rounds don't run while there is work left. Must be called
+ * repeatedly by a single thread on every rank until it returns something
+ * other than TERMINATION_UNKNOWN; every rank gets the same result from the
+ * same round.
+ *
+ * Uses Mattern's four-counter method: since the counters on different ranks
+ * aren't read at the same instant, a batch is only known to have been
+ * received if the total sent now matches the total received at the previous
+ * round.
+ *
+ * @param stopped Whether this rank has stopped step 2 because the sink was
+ *                found
+ */
+enum termination_result poll_termination(bool stopped) {
+  if (termination_state != TERMINATION_UNKNOWN) {
+    return termination_state;
+  }
+  if (termination_request != MPI_REQUEST_NULL) {
+    int done = 0;
+    MPI_Test(&termination_request, &done, MPI_STATUS_IGNORE);
+    if (!done) {
+      return TERMINATION_UNKNOWN;
+    }
+    if (termination_total[3] > 0) {
+      termination_state = TERMINATION_STOPPED;
+    } else if (termination_total[0] == 0 &&
+               termination_total[1] == termination_total[2] &&
+               termination_total[1] == checked_batches_received) {
+      termination_state = TERMINATION_DONE;
+    }
+    checked_batches_received = termination_total[2];
+    if (termination_state != TERMINATION_UNKNOWN) {
+      return termination_state;
+    }
+  }
+  bool busy = __sync_fetch_and_add(&pending_work, 0) != 0;
+  if (busy && !stopped) {
+    return TERMINATION_UNKNOWN;
+  }
+  termination_local[0] = busy ? 1 : 0;
+  termination_local[1] = __sync_fetch_and_add(&batches_sent, 0);
+  termination_local[2] = batches_received;
+  termination_local[3] = stopped ? 1 : 0;
+  MPI_Iallreduce(termination_local, termination_total, 4, MPI_INT, MPI_SUM,
+                 termination_comm, &termination_request);
+  return TERMINATION_UNKNOWN;
+}
+
+/**
+ * Waits for every rank to finish sending, while discarding anything left over
+ * from earlier passes, then frees the label communicator. Called by every rank
+ * once the algorithm is complete.
+ */
+void stop_label_comm() {
+  MPI_Request barrier = MPI_REQUEST_NULL;
+  bool sends_done = false;
+  int done = 0;
+  while (!done) {
+    int count = 0;
+    int indices[RECV_SLOT_COUNT];
+    MPI_Testsome(RECV_SLOT_COUNT, recv_pool.requests.data(), &count, indices,
+                 MPI_STATUSES_IGNORE);
+    for (int i = 0; i < count && count != MPI_UNDEFINED; ++i) {
+      post_label_recv(indices[i]);
+    }
+    if (!sends_done) {
+      MPI_Testall(SEND_SLOT_COUNT, send_pool.requests.data(), &done,
+                  MPI_STATUSES_IGNORE);
+      if (done) {
+        // nothing more will be sent from this rank
+        sends_done = true;
+        done = 0;
+        MPI_Ibarrier(label_comm, &barrier);
+      }
+    } else {
+      MPI_Test(&barrier, &done, MPI_STATUS_IGNORE);
+    }
+  }
+  for (int slot = 0; slot < RECV_SLOT_COUNT; ++slot) {
+    MPI_Cancel(&recv_pool.requests[slot]);
+    MPI_Wait(&recv_pool.requests[slot], MPI_STATUS_IGNORE);
+  }
+  MPI_Comm_free(&label_comm);
+  MPI_Comm_free(&termination_comm);
+}
+
+/*********** Label Message Batching ***************/
+
+/**
+ * Labelling messages held back until the end of the current BFS level, if
+ * @c level_synchronous is set. Indexed by thread ID, then by batch_index(), so
+ * each thread only adds to its own.
+ */
+vector<vector<vector<struct message_data>>> level_outboxes;
+
+/**
+ * Labelling messages (SET_TO_LABEL through COMPUTE_SINK_LABEL) waiting to be
+ * sent to another rank. They are sent as a single MPI message holding an array
+ * of message_data, with the usual tag.
+ */
+struct label_batch {
+  Mutex lock;
+  std::vector<struct message_data> messages;
+  /// When the oldest message in the batch was added
+  double first_added;
+};
+
+/// Outgoing batches, indexed by batch_index()
+struct label_batch *label_batches;
+/// Held by the thread checking for batches that have waited too long
+Mutex flush_lock;
+/// The next time a worker should check for batches that have waited too long
+double next_flush_time;
+
+int batch_index(int dest, int tag) {
+  return LABEL_TAG_COUNT * dest + (tag - SET_TO_LABEL);
+}
+
+/**
+ * Starts sending a batch of labelling messages with MPI_Isend, and clears it.
+ * If every send slot is in use, waits for one to free up.
+ */
+void send_batch(int dest, int tag, vector<struct message_data> &messages,
+                int tid) {
+  int count = messages.size();
+  DEBUG(2, "S2: sending %d %s msgs to R%d", count, tag2str(tag), dest);
+  while (true) {
+    {
+      ScopedLock l(send_pool.lock);
+      if (send_pool.free_slots.empty()) {
+        reap_sends();
+      }
+      if (!send_pool.free_slots.empty()) {
+        int slot = send_pool.free_slots.back();
+        send_pool.free_slots.pop_back();
+        vector<struct message_data> &buffer = send_pool.buffers[slot];
+        buffer.swap(messages);
+        MPI_Isend(buffer.data(), count, MPI_MESSAGE_TYPE, dest, tag,
+                  label_comm, &send_pool.requests[slot]);
+        __sync_fetch_and_add(&batches_sent, 1);
+        break;
+      }
+    }
+    if (__atomic_load_n(&sink_found, __ATOMIC_SEQ_CST)) {
+      // the receiver may already be in step 3, so it won't free up a slot
+      // until the next pass; this batch is useless by then anyway
+      break;
+    }
+    sched_yield();
+  }
+  // the batch is counted in batches_sent now
+  __sync_fetch_and_sub(&pending_work, count);
+  messages.clear();
+}
+
+/**
+ * Adds a labelling message to the batch for @p dest, and sends the batch if it
+ * is full.
+ *
+ * Queued messages count towards @c pending_work until they are sent, so this
+ * rank is not considered idle while it is holding on to them. If
+ * @c level_synchronous is set, the message waits in this thread's level outbox
+ * instead, and doesn't count as work.
+ */
+void queue_label_message(int dest, int tag, const struct message_data &msg,
+                         int tid) {
+  if (level_synchronous) {
+    level_outboxes[tid][batch_index(dest, tag)].push_back(msg);
+    __sync_fetch_and_add(&label_messages_sent, 1);
+    return;
+  }
+  struct label_batch &batch = label_batches[batch_index(dest, tag)];
+  vector<struct message_data> full;
+  __sync_fetch_and_add(&pending_work, 1);
+  __sync_fetch_and_add(&label_messages_sent, 1);
+  {
+    ScopedLock l(batch.lock);
+    if (batch.messages.empty()) {
+      batch.first_added = MPI_Wtime();
+    }
+    batch.messages.push_back(msg);
+    if (batch.messages.size() >= LABEL_BATCH_SIZE) {
+      // send it after releasing the lock
+      full.swap(batch.messages);
+      batch.messages.reserve(LABEL_BATCH_SIZE);
+    }
+  }
+  if (!full.empty()) {
+    send_batch(dest, tag, full, tid);
+  }
+}
+
+/**
+ * Sends all non-empty batches whose oldest message was added at or before
+ * @p added_before.
+ */
+void flush_label_batches(double added_before, int tid) {
+  vector<struct message_data> messages;
+  messages.reserve(LABEL_BATCH_SIZE);
+  for (int dest = 0; dest < mpi_size; ++dest) {
+    for (int tag = SET_TO_LABEL; tag <= COMPUTE_SINK_LABEL; ++tag) {
+      struct label_batch &batch = label_batches[batch_index(dest, tag)];
+      {
+        ScopedLock l(batch.lock);
+        if (batch.messages.empty() || batch.first_added > added_before) {
+          continue;
+        }
+        messages.swap(batch.messages);
+      }
+      send_batch(dest, tag, messages, tid);
+    }
+  }
+}
+
+/**
+ * Sends batches that have been waiting longer than @c LABEL_FLUSH_INTERVAL.
+ * Cheap enough to call after every edge.
+ */
+void flush_stale_label_batches(int tid) {
+  double now = MPI_Wtime();
+  if (now < next_flush_time || !flush_lock.try_lock()) {
+    return;
+  }
+  next_flush_time = now + LABEL_FLUSH_INTERVAL;
+  flush_label_batches(now - LABEL_FLUSH_INTERVAL, tid);
+  flush_lock.unlock();
+}
+
+/**
+ * Sends the messages in @p send_buffer, laid out by destination rank, with a
+ * single MPI_Alltoallv over @c label_comm. Must be called by one thread on
+ * every rank at once.
+ *
+ * @param send_counts @p block message counts for each rank, in order; each
+ *                    rank is sent the sum of its counts
+ * @param recv_counts Gets the matching counts from each rank
+ * @param status Sent to every rank along with the counts, so callers can agree
+ *               on when to stop without another collective
+ * @return The sum of @p status over all ranks
+ */
+int exchange_messages(const vector<int> &send_counts, int block,
+                      const vector<struct message_data> &send_buffer,
+                      vector<int> &recv_counts,
+                      vector<struct message_data> &recv_buffer,
+                      int status = 0) {
+  // every rank tells every other how many messages to expect, followed by its
+  // status
+  vector<int> send_header((block + 1) * mpi_size, status);
+  vector<int> recv_header((block + 1) * mpi_size, 0);
+  for (int rank = 0; rank < mpi_size; ++rank) {
+    copy(send_counts.begin() + block * rank,
+         send_counts.begin() + block * (rank + 1),
+         send_header.begin() + (block + 1) * rank);
+  }
+  MPI_Alltoall(send_header.data(), block + 1, MPI_INT, recv_header.data(),
+               block + 1, MPI_INT, label_comm);
+
+  recv_counts.assign(send_counts.size(), 0);
+  vector<int> rank_send_counts(mpi_size, 0), send_displs(mpi_size, 0);
+  vector<int> rank_recv_counts(mpi_size, 0), recv_displs(mpi_size, 0);
+  int send_total = 0;
+  int recv_total = 0;
+  int status_total = 0;
+  for (int rank = 0; rank < mpi_size; ++rank) {
+    send_displs[rank] = send_total;
+    recv_displs[rank] = recv_total;
+    for (int i = 0; i < block; ++i) {
+      recv_counts[block * rank + i] = recv_header[(block + 1) * rank + i];
+      rank_send_counts[rank] += send_counts[block * rank + i];
+      rank_recv_counts[rank] += recv_counts[block * rank + i];
+    }
+    status_total += recv_header[(block + 1) * rank + block];
+    send_total += rank_send_counts[rank];
+    recv_total += rank_recv_counts[rank];
+  }
+  recv_buffer.resize(recv_total);
+  MPI_Alltoallv(send_buffer.data(), rank_send_counts.data(),
+                send_displs.data(), MPI_MESSAGE_TYPE, recv_buffer.data(),
+                rank_recv_counts.data(), recv_displs.data(), MPI_MESSAGE_TYPE,
+                label_comm);
+  return status_total;
+}
+
+/**
+ * Sends every message in @c level_outboxes to its destination with
+ * exchange_messages(), and queues the ones received for the worker threads.
+ * Called by thread 0 on every rank at the end of a level, while the workers
+ * are idle.
+ */
+void exchange_level_messages(int tid) {
+  int slots = LABEL_TAG_COUNT * mpi_size;
+  vector<int> send_counts(slots, 0);
+  // lay the messages out by destination, then by tag, like the counts
+  vector<struct message_data> send_buffer;
+  for (int i = 0; i < slots; ++i) {
+    for (size_t t = 0; t < level_outboxes.size(); ++t) {
+      vector<struct message_data> &outbox = level_outboxes[t][i];
+      send_counts[i] += outbox.size();
+      send_buffer.insert(send_buffer.end(), outbox.begin(), outbox.end());
+      outbox.clear();
+    }
+  }
+  vector<int> recv_counts;
+  vector<struct message_data> recv_buffer;
+  exchange_messages(send_counts, LABEL_TAG_COUNT, send_buffer, recv_counts,
+                    recv_buffer);
+  DEBUG(2, "S2: exchanged %lu label msgs for %lu", send_buffer.size(),
+        recv_buffer.size());
+
+  ScopedLock l(completion_lock);
+  int begin = 0;
+  for (int i = 0; i < slots; ++i) {
+    if (recv_counts[i] == 0) {
+      continue;
+    }
+    struct received_batch batch;
+    batch.tag = SET_TO_LABEL + i % LABEL_TAG_COUNT;
+    batch.source = i / LABEL_TAG_COUNT;
+    batch.messages.assign(recv_buffer.begin() + begin,
+                          recv_buffer.begin() + begin + recv_counts[i]);
+    queue_received_batch(batch);
+    begin += recv_counts[i];
+  }
+}
+
+/*********** Sink Distance Estimates ***************/
+
+/// Number of passes between recomputing @c sink_distance
+#define SINK_DISTANCE_REFRESH_PASSES 8
+/// Most rounds of border exchanges compute_sink_distances() runs before it
+/// gives up on guiding the search
+#define SINK_DISTANCE_MAX_ROUNDS 64
+
+/// The pass and scaling delta that @c sink_distance was last computed for
+int sink_distance_pass = 0;
+int sink_distance_delta = 0;
+
+/// Heap key of an edge to a node @p dist steps from the sink, so the edges
+/// leading closest to the sink are taken first. Always positive.
+int sink_distance_key(int dist) { return numeric_limits<int>::max() - dist; }
+
+/// A local node whose distance was lowered to @c first, waiting to be expanded
+typedef pair<int, local_id> sink_distance_entry;
+
+/**
+ * Lowers the distance of @c vertices[v] to @p dist, if it is shorter, and adds
+ * it to @p reached if so.
+ */
+void lower_sink_distance(local_id v, int dist,
+                         vector<sink_distance_entry> &reached) {
+  if (dist < sink_distance[v]) {
+    sink_distance[v] = dist;
+    reached.push_back(sink_distance_entry(dist, v));
+  }
+}
+
+/**
+ * Lowers the distances of the local nodes with residual paths to the nodes in
+ * @p seeds, by a BFS that starts from every seed at its own distance. The
+ * nodes are expanded in order of distance, merging the sorted seeds with the
+ * nodes reached from them, so each is expanded once unless a later exchange
+ * lowers it again. The edges from nodes on other ranks are left in
+ * @p outboxes, for them to do the same.
+ */
+void relax_sink_distances(vector<sink_distance_entry> &seeds,
+                          vector<vector<struct message_data>> &outboxes) {
+  sort(seeds.begin(), seeds.end());
+  EdgeRange<struct out_edge> all_out_edges = vertices.all_out_edges();
+  vector<sink_distance_entry> reached;
+  size_t s = 0;
+  size_t r = 0;
+  while (s < seeds.size() || r < reached.size()) {
+    sink_distance_entry entry;
+    if (r < reached.size() && (s == seeds.size() || reached[r] < seeds[s])) {
+      entry = reached[r++];
+    } else {
+      entry = seeds[s++];
+    }
+    int dist = entry.first;
+    local_id w = entry.second;
+    if (dist != sink_distance[w]) {
+      continue; // lowered again since it was queued
+    }
+    const struct vertex vert = vertices[w];
+    // in-edges with residual capacity lead here from their "from" node
+    for (unsigned int i = 0; i < vert.in_edges.size(); ++i) {
+      const struct in_edge &edge = vert.in_edges[i];
+      if (edge.rank_location != mpi_rank) {
+        struct message_data msg = {
+            vert.id,           // sender's node
+            edge.dest_node_id, // receiver's node
+            dist,              // sender's distance
+            pass,              // current pass
+            edge.out_index,    // edge index, to check on the receiver
+            (global_id)-1,     // branch (unused)
+        };
+        outboxes[edge.rank_location].push_back(msg);
+        continue;
+      }
+      const struct out_edge &out =
+          all_out_edges[vertices.out_edge_offset(edge.vert_index) +
+                        edge.out_index];
+      if (out.capacity - out.flow >= scaling_delta) {
+        lower_sink_distance(edge.vert_index, dist + 1, reached);
+      }
+    }
+    // and the reverse of out-edges with flow, from their "to" node
+    for (unsigned int i = 0; i < vert.out_edges.size(); ++i) {
+      const struct out_edge &edge = vert.out_edges[i];
+      if (edge.flow < scaling_delta) {
+        continue;
+      }
+      if (edge.rank_location != mpi_rank) {
+        struct message_data msg = {
+            vert.id,           // sender's node
+            edge.dest_node_id, // receiver's node
+            dist,              // sender's distance
+            pass,              // current pass
+            (unsigned int)-1,  // edge index (already checked)
+            (global_id)-1,     // branch (unused)
+        };
+        outboxes[edge.rank_location].push_back(msg);
+      } else {
+        lower_sink_distance(edge.vert_index, dist + 1, reached);
+      }
+    }
+  }
+}
+
+/**
+ * Fills in @c sink_distance and @c border_sink_distance with the number of
+ * residual edges between each node and the sink. Each rank runs a BFS over its
+ * own nodes from the ones reached so far, and then the distances of the border
+ * nodes are exchanged with exchange_messages(), which lower the distances of
+ * their neighbors, until no rank has anything to send. So the number of rounds
+ * depends on how often the shortest paths cross between ranks, rather than on
+ * their length. If that takes more than SINK_DISTANCE_MAX_ROUNDS,
+ * @c guided_search is turned off. Called by thread 0 on every rank in step 1,
+ * while the workers wait.
+ *
+ * A rank only knows the capacity of its out-edges, so for an in-edge from
+ * another rank, the rank holding the edge checks whether it has residual
+ * capacity.
+ */
+void compute_sink_distances(int tid) {
+  sink_distance.assign(vertices.size(), NO_SINK_DISTANCE);
+  border_sink_distance.assign(border_labelled_pass.size(), NO_SINK_DISTANCE);
+  vector<sink_distance_entry> seeds;
+  local_id sink_idx = lookup_global_id(sink_id);
+  if (sink_idx != (local_id)-1) {
+    sink_distance[sink_idx] = 0;
+    seeds.push_back(sink_distance_entry(0, sink_idx));
+  }
+  vector<vector<struct message_data>> outboxes(mpi_size);
+  vector<int> send_counts(mpi_size), recv_counts;
+  vector<struct message_data> send_buffer, recv_buffer;
+  int rounds = 0;
+  bool complete = false;
+  while (rounds < SINK_DISTANCE_MAX_ROUNDS) {
+    relax_sink_distances(seeds, outboxes);
+    seeds.clear();
+
+    send_buffer.clear();
+    for (int rank = 0; rank < mpi_size; ++rank) {
+      send_counts[rank] = outboxes[rank].size();
+      send_buffer.insert(send_buffer.end(), outboxes[rank].begin(),
+                         outboxes[rank].end());
+      outboxes[rank].clear();
+    }
+    // stop once no rank has anything to send
+    int senders = exchange_messages(send_counts, 1, send_buffer, recv_counts,
+                                    recv_buffer, send_buffer.empty() ? 0 : 1);
+    ++rounds;
+    if (senders == 0) {
+      complete = true;
+      break;
+    }
+    for (size_t i = 0; i < recv_buffer.size(); ++i) {
+      const struct message_data &msg = recv_buffer[i];
+      local_id v = lookup_global_id(msg.receivers_node);
+      if (msg.edge_index != (unsigned int)-1) {
+        const struct out_edge &out = vertices[v].out_edges[msg.edge_index];
+        if (out.capacity - out.flow < scaling_delta) {
+          continue;
+        }
+      }
+      // the sender is a neighbor, so it has a border slot here
+      int &known = border_sink_distance[border_slots.find(msg.senders_node)];
+      known = min(known, msg.value);
+      if (msg.value + 1 < sink_distance[v]) {
+        sink_distance[v] = msg.value + 1;
+        seeds.push_back(sink_distance_entry(msg.value + 1, v));
+      }
+    }
+  }
+  sink_distance_pass = pass;
+  sink_distance_delta = scaling_delta;
+  DEBUG(1, "Computed sink distances in %d rounds", rounds);
+  if (!complete) {
+    // the shortest paths cross between ranks too often for the estimates to
+    // pay off, and any nodes left out would be taken in no particular order
+    DEBUG(1, "Sink distances are incomplete, so the search won't be guided");
+    guided_search = false;
+  }
 }
 
 /*********** Zoltan Query Functions ***************/
@@ -260,7 +1163,7 @@ void user_return_edge_list(void *data, int num_gid_entries, int num_lid_entries,
                            int wgt_dim, float *ewgts, int *ierr) {
   // printf("-------%d, %d-%d; g:%d,l:%d\n", vertices.size(), num_gid_entries,
   //        num_lid_entries, *global, *local);
-  const vertex &curr_vertex = vertices[*local];
+  const vertex curr_vertex = vertices[*local];
 
   // printf("step 1\n");
   // go through all neighboring edges. in then out edges
@@ -292,7 +1195,7 @@ void user_pack_vertex(void *data, int num_gid_entries, int num_lid_entries,
                       ZOLTAN_ID_PTR global, ZOLTAN_ID_PTR local, int dest,
                       int size, char *buf, int *ierr) {
   auto *packed = (struct packed_vert *)buf;
-  struct vertex &vert = vertices[*local];
+  struct vertex vert = vertices[*local];
   packed->out_count = vert.out_edges.size();
   packed->in_count = vert.in_edges.size();
 
@@ -305,25 +1208,23 @@ void user_pack_vertex(void *data, int num_gid_entries, int num_lid_entries,
 void user_unpack_vertex(void *data, int num_gid_entries, ZOLTAN_ID_PTR global,
                         int size, char *bytes, int *ierr) {
   auto *packed = (struct packed_vert *)bytes;
-  struct out_edge out_temp = {};
-  struct in_edge in_temp = {};
-  struct vertex vert = {*global,
-                        vector<struct out_edge>(packed->out_count, out_temp),
-                        vector<struct in_edge>(packed->in_count, in_temp)};
   size_t out_size = sizeof(struct out_edge[packed->out_count]);
-  size_t in_size = sizeof(struct in_edge[packed->in_count]);
-  memcpy(vert.out_edges.data(), packed->data, out_size);
-  memcpy(vert.in_edges.data(), packed->data + out_size, in_size);
-
-  // update rank_location of all edges
-  for (auto it = vert.out_edges.begin(); it != vert.out_edges.end(); ++it) {
-    it->rank_location = mpi_rank;
+  auto *out_edges = (struct out_edge *)packed->data;
+  auto *in_edges = (struct in_edge *)(packed->data + out_size);
+
+  // append the vertex and its edges to the end of the CSR arrays, updating
+  // rank_location of all edges
+  vertices.add_vertex(*global);
+  for (size_t i = 0; i < packed->out_count; ++i) {
+    struct out_edge edge = out_edges[i];
+    edge.rank_location = mpi_rank;
+    vertices.push_out_edge(edge);
   }
-  for (auto it = vert.in_edges.begin(); it != vert.in_edges.end(); ++it) {
-    it->rank_location = mpi_rank;
+  for (size_t i = 0; i < packed->in_count; ++i) {
+    struct in_edge edge = in_edges[i];
+    edge.rank_location = mpi_rank;
+    vertices.push_in_edge(edge);
   }
-
-  vertices.push_back(vert);
 }
 
 // Copy all needed data for a single object into a communication buffer
@@ -339,667 +1240,2915 @@ int user_return_obj_size(void *data, int num_global_ids, ZOLTAN_ID_PTR global,
 /************ Zoltan Query Functions End ***************/
 
 /**
- * Inserts edges between @c vertices[vert_idx] and neighboring unlabelled
- * nodes into the edge queue.
- *
- * @param vert_idx The local index of a newly labelled node.
+ * Whether the edges of the search from the sink go in the deques while the
+ * edges of the search from the source go in the heaps. With @c guided_search,
+ * the estimates only point toward the sink, so the search from the sink isn't
+ * guided.
  */
-void insert_edges(local_id vert_idx, int tid) {
-  const struct vertex &v = vertices[vert_idx];
-  EdgeQueue fragment = EdgeQueue();
-  DEBUG(2, "Adding %lu edges to queue", v.out_edges.size() + v.in_edges.size());
-  for (unsigned int i = 0; i < v.out_edges.size(); ++i) {
-    const out_edge &edge = v.out_edges[i];
-    if (edge.rank_location == mpi_rank && labels[edge.vert_index].value != 0) {
-      continue; // already has a label, skip it
-    }
-    if (edge.dest_node_id == labels[vert_idx].prev_node) {
-      continue; // we came from here, so skip it
-    }
-    edge_entry temp = {
-        vert_idx, // vertex_index
-        true,     // is_outgoing
-        i,        // edge_index
-    };
-    fragment.push(temp);
-  }
-
-  for (unsigned int i = 0; i < v.in_edges.size(); ++i) {
-    const in_edge &edge = v.in_edges[i];
-    if (edge.rank_location == mpi_rank && labels[edge.vert_index].value != 0) {
-      continue; // already has a label, skip it
-    }
-    if (edge.dest_node_id == labels[vert_idx].prev_node) {
-      continue; // we came from here, so skip it
-    }
-    edge_entry temp = {
-        vert_idx, // vertex_index
-        false,    // is_outgoing
-        i,        // edge_index
-    };
-    fragment.push(temp);
-  }
-  t_lock.lock();
-  fragment.merge_into(edge_queue);
-  t_lock.unlock();
+bool sink_search_in_deques() {
+  return guided_search && bidirectional_search;
 }
 
 /**
- * Sets @c sink_found and returns the local id of the sink node if it was
- * found; otherwise returns (local_id)-1.
- *
- * @param entry The edge to process.
+ * Adds an edge to this thread's deque, or to its heap with the given key if
+ * use_edge_heaps().
  */
-local_id handle_out_edge(const struct edge_entry &entry, int tid);
+void push_edge(const struct edge_entry &entry, int key, int tid) {
+  if (use_edge_heaps() &&
+      !(entry.reverse_search && sink_search_in_deques())) {
+    edge_heaps[tid].push(entry, key);
+  } else {
+    edge_deques[tid].push(entry);
+  }
+}
 
 /**
- * Sets @c sink_found and returns the local id of the sink node if it was
- * found; otherwise returns (local_id)-1.
- *
- * @param entry The edge to process.
+ * Returns the flow through in-edge @p i of @c vertices[vert_idx], from the
+ * "from" node's out-edge if it is local, or else from @c mirror_flow.
  */
-local_id handle_in_edge(const struct edge_entry &entry, int tid);
+int in_edge_flow(local_id vert_idx, unsigned int i) {
+  const struct in_edge &edge = vertices[vert_idx].in_edges[i];
+  if (edge.rank_location == mpi_rank) {
+    return vertices[edge.vert_index].out_edges[edge.out_index].flow;
+  }
+  return mirror_flow[vertices.in_edge_offset(vert_idx) + i];
+}
 
 /**
- * Returns @c true if @p curr_idx is the sink node and we successfully set its
- * label.
+ * Adds @p delta to the mirrored flow of the edge to @c vertices[to_idx] from
+ * @p from_node on another rank, which is at @p out_index in that node's
+ * @c out_edges list.
  */
-bool set_label(global_id prev_node, int prev_rank, local_id prev_idx,
-               local_id curr_idx, int value, int tid);
+void add_mirror_flow(local_id to_idx, global_id from_node,
+                     unsigned int out_index, int delta, int tid) {
+  const EdgeRange<struct in_edge> &in_edges = vertices[to_idx].in_edges;
+  for (unsigned int i = 0; i < in_edges.size(); ++i) {
+    if (in_edges[i].dest_node_id == from_node &&
+        in_edges[i].out_index == out_index) {
+      mirror_flow[vertices.in_edge_offset(to_idx) + i] += delta;
+      return;
+    }
+  }
+  ERROR("no in-edge from %llu to %llu", from_node, vertices[to_idx].id);
+}
 
 /**
- * Waits for a message with the given tag and sender, and discard any
- * non-matching messages.
+ * Gives a border slot to every node on another rank that has an edge to a
+ * local node, and lists the edges of each slot. Called by every rank before
+ * the algorithm starts.
+ */
+void assign_border_slots() {
+  unordered_map<global_id, size_t> slot_of;
+  vector<global_id> &ids = border_ids;
+  ids.clear();
+  border_slot_ranks.clear();
+  out_border_slot.assign(vertices.all_out_edges().size(), -1);
+  in_border_slot.assign(vertices.all_in_edges().size(), -1);
+  for (local_id v = 0; v < vertices.size(); ++v) {
+    const struct vertex vert = vertices[v];
+    size_t out_base = vertices.out_edge_offset(v);
+    size_t in_base = vertices.in_edge_offset(v);
+    for (unsigned int i = 0; i < vert.out_edges.size(); ++i) {
+      const struct out_edge &edge = vert.out_edges[i];
+      if (edge.rank_location != mpi_rank) {
+        auto it = slot_of.insert(make_pair(edge.dest_node_id, ids.size()));
+        if (it.second) {
+          ids.push_back(edge.dest_node_id);
+          border_slot_ranks.push_back(edge.rank_location);
+        }
+        out_border_slot[out_base + i] = it.first->second;
+      }
+    }
+    for (unsigned int i = 0; i < vert.in_edges.size(); ++i) {
+      const struct in_edge &edge = vert.in_edges[i];
+      if (edge.rank_location != mpi_rank) {
+        auto it = slot_of.insert(make_pair(edge.dest_node_id, ids.size()));
+        if (it.second) {
+          ids.push_back(edge.dest_node_id);
+          border_slot_ranks.push_back(edge.rank_location);
+        }
+        in_border_slot[in_base + i] = it.first->second;
+      }
+    }
+  }
+  border_slots.assign(ids, false);
+  border_labelled_pass.assign(ids.size(), 0);
+
+  // counting sort of the edges by slot
+  border_edge_offsets.assign(ids.size() + 1, 0);
+  for (size_t i = 0; i < out_border_slot.size(); ++i) {
+    if (out_border_slot[i] != (size_t)-1) {
+      border_edge_offsets[out_border_slot[i] + 1]++;
+    }
+  }
+  for (size_t i = 0; i < in_border_slot.size(); ++i) {
+    if (in_border_slot[i] != (size_t)-1) {
+      border_edge_offsets[in_border_slot[i] + 1]++;
+    }
+  }
+  for (size_t s = 0; s < ids.size(); ++s) {
+    border_edge_offsets[s + 1] += border_edge_offsets[s];
+  }
+  border_edges.resize(border_edge_offsets[ids.size()]);
+  vector<size_t> cursor(border_edge_offsets.begin(),
+                        border_edge_offsets.end() - 1);
+  for (local_id v = 0; v < vertices.size(); ++v) {
+    const struct vertex vert = vertices[v];
+    size_t out_base = vertices.out_edge_offset(v);
+    size_t in_base = vertices.in_edge_offset(v);
+    for (unsigned int i = 0; i < vert.out_edges.size(); ++i) {
+      size_t slot = out_border_slot[out_base + i];
+      if (slot != (size_t)-1) {
+        struct edge_entry entry = {v, true, false, i};
+        border_edges[cursor[slot]++] = entry;
+      }
+    }
+    for (unsigned int i = 0; i < vert.in_edges.size(); ++i) {
+      size_t slot = in_border_slot[in_base + i];
+      if (slot != (size_t)-1) {
+        struct edge_entry entry = {v, false, false, i};
+        border_edges[cursor[slot]++] = entry;
+      }
+    }
+  }
+}
+
+/// Returns @c true if the node in border @p slot is known to be labelled.
+bool border_labelled(size_t slot) {
+  return __atomic_load_n(&border_labelled_pass[slot], __ATOMIC_RELAXED) ==
+         pass;
+}
+
+/**
+ * Marks the node in border @p slot as labelled. Returns @c false if it already
+ * was, so no label message needs to be sent to it.
+ */
+bool claim_border_label(size_t slot) {
+  int old_pass = __atomic_load_n(&border_labelled_pass[slot], __ATOMIC_RELAXED);
+  while (old_pass != pass) {
+    if (__atomic_compare_exchange_n(&border_labelled_pass[slot], &old_pass,
+                                    pass, false, __ATOMIC_RELAXED,
+                                    __ATOMIC_RELAXED)) {
+      return true;
+    }
+  }
+  __sync_fetch_and_add(&label_messages_filtered, 1);
+  return false;
+}
+
+/**
+ * Adds out-edges @p first to @p end of @c vertices[vert_idx] to the edge
+ * queue, except those to nodes known to be labelled and those with no residual
+ * capacity in the direction of the search.
+ *
+ * @param v The vertex @c vertices[vert_idx]
+ * @param reverse_search Whether @p vert_idx has a sink label, rather than a
+ *                       label
+ * @param skip_local Whether edges to local nodes are left to the bottom-up
+ *                   sweeps
+ */
+void queue_out_edges(const struct vertex &v, local_id vert_idx,
+                     unsigned int first, unsigned int end, bool reverse_search,
+                     bool skip_local, int tid) {
+  const vector<struct label> &tree = reverse_search ? sink_labels : labels;
+  int label_val = abs(tree[vert_idx].value);
+  size_t out_base = vertices.out_edge_offset(vert_idx);
+  for (unsigned int i = first; i < end; ++i) {
+    const out_edge &edge = v.out_edges[i];
+    if (edge.rank_location == mpi_rank &&
+        (skip_local || tree[edge.vert_index].value != 0)) {
+      continue; // already has a label, skip it
+    }
+    if (edge.rank_location != mpi_rank && !reverse_search &&
+        border_labelled(out_border_slot[out_base + i])) {
+      continue; // known to have a label
+    }
+    if (edge.dest_node_id == tree[vert_idx].prev_node) {
+      continue; // we came from here, so skip it
+    }
+    int key = 0;
+    if (widest_path) {
+      // the bottleneck of the path through this edge
+      key = min(label_val,
+                reverse_search ? edge.flow : edge.capacity - edge.flow);
+      if (key < scaling_delta) {
+        continue; // no residual capacity
+      }
+    }
+    if (guided_search && !reverse_search) {
+      int dist = edge.rank_location == mpi_rank
+                     ? sink_distance[edge.vert_index]
+                     : border_sink_distance[out_border_slot[out_base + i]];
+      key = sink_distance_key(dist);
+    }
+    edge_entry temp = {
+        vert_idx,       // vertex_index
+        true,           // is_outgoing
+        reverse_search, // reverse_search
+        i,              // edge_index
+    };
+    // count the edge before it can be stolen and processed
+    __sync_fetch_and_add(&pending_work, 1);
+    push_edge(temp, key, tid);
+  }
+}
+
+/// Like queue_out_edges(), for in-edges @p first to @p end.
+void queue_in_edges(const struct vertex &v, local_id vert_idx,
+                    unsigned int first, unsigned int end, bool reverse_search,
+                    bool skip_local, int tid) {
+  const vector<struct label> &tree = reverse_search ? sink_labels : labels;
+  int label_val = abs(tree[vert_idx].value);
+  size_t in_base = vertices.in_edge_offset(vert_idx);
+  for (unsigned int i = first; i < end; ++i) {
+    const in_edge &edge = v.in_edges[i];
+    if (edge.rank_location == mpi_rank &&
+        (skip_local || tree[edge.vert_index].value != 0)) {
+      continue; // already has a label, skip it
+    }
+    if (edge.rank_location != mpi_rank && !reverse_search &&
+        border_labelled(in_border_slot[in_base + i])) {
+      continue; // known to have a label
+    }
+    if (edge.dest_node_id == tree[vert_idx].prev_node) {
+      continue; // we came from here, so skip it
+    }
+    int key = 0;
+    if (!reverse_search) {
+      // the flow is known even if the "from" node is remote
+      key = min(label_val, in_edge_flow(vert_idx, i));
+      if (key < scaling_delta) {
+        continue; // no flow to cancel
+      }
+    } else if (widest_path) {
+      key = label_val;
+      // the "from" node holds the capacity, so only check it if it is local
+      if (edge.rank_location == mpi_rank) {
+        const out_edge &out =
+            vertices[edge.vert_index].out_edges[edge.out_index];
+        key = min(key, out.capacity - out.flow);
+      }
+      if (key < scaling_delta) {
+        continue; // no residual capacity
+      }
+    }
+    if (guided_search && !reverse_search) {
+      int dist = edge.rank_location == mpi_rank
+                     ? sink_distance[edge.vert_index]
+                     : border_sink_distance[in_border_slot[in_base + i]];
+      key = sink_distance_key(dist);
+    }
+    edge_entry temp = {
+        vert_idx,       // vertex_index
+        false,          // is_outgoing
+        reverse_search, // reverse_search
+        i,              // edge_index
+    };
+    __sync_fetch_and_add(&pending_work, 1);
+    push_edge(temp, key, tid);
+  }
+}
+
+/**
+ * Inserts edges between @c vertices[vert_idx] and neighboring unlabelled
+ * nodes into the edge queue.
+ *
+ * @param vert_idx The local index of a newly labelled node.
+ * @param reverse_search Whether @p vert_idx was given a sink label, rather
+ *                       than a label
+ */
+void insert_edges(local_id vert_idx, int tid, bool reverse_search = false) {
+  const struct vertex &v = vertices[vert_idx];
+  // local edges are left to the next bottom-up sweep
+  bool skip_local =
+      !reverse_search && __atomic_load_n(&bottom_up, __ATOMIC_RELAXED);
+  DEBUG(2, "Adding %lu edges to queue", v.out_edges.size() + v.in_edges.size());
+  queue_out_edges(v, vert_idx, 0, v.out_edges.size(), reverse_search,
+                  skip_local, tid);
+  queue_in_edges(v, vert_idx, 0, v.in_edges.size(), reverse_search, skip_local,
+                 tid);
+}
+
+/**
+ * Takes the wider of the widest edges in this thread's heap and in one other
+ * heap, so the threads roughly follow the global order, or steals from any
+ * other heap if both are empty.
+ *
+ * @return @c true if an edge was stored in @p entry
+ */
+bool find_widest_edge(struct edge_entry &entry, int tid) {
+  // which other heap to compare against, in turn
+  static thread_local size_t other_offset = 0;
+  EdgeHeap &own = edge_heaps[tid];
+  if (num_threads > 1) {
+    other_offset = other_offset % (num_threads - 1) + 1;
+    EdgeHeap &other = edge_heaps[(tid + other_offset) % num_threads];
+    if (other.peek_key() > own.peek_key() && other.try_pop(entry)) {
+      return true;
+    }
+  }
+  if (own.pop(entry)) {
+    return true;
+  }
+  for (size_t i = 1; i < num_threads; ++i) {
+    if (edge_heaps[(tid + i) % num_threads].try_pop(entry)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Takes an edge from this thread's deque, or steals one from another thread if
+ * it is empty.
+ *
+ * @return @c true if an edge was stored in @p entry
+ */
+bool find_deque_edge(struct edge_entry &entry, int tid) {
+  if (edge_deques[tid].pop(entry)) {
+    return true;
+  }
+  for (size_t i = 1; i < num_threads; ++i) {
+    if (edge_deques[(tid + i) % num_threads].steal(entry)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Takes the next edge to process, from the heaps if use_edge_heaps() or else
+ * from the deques. If sink_search_in_deques(), the two searches take turns.
+ *
+ * @return @c true if an edge was stored in @p entry
+ */
+bool find_edge(struct edge_entry &entry, int tid) {
+  if (!use_edge_heaps()) {
+    return find_deque_edge(entry, tid);
+  }
+  if (!sink_search_in_deques()) {
+    return find_widest_edge(entry, tid);
+  }
+  static thread_local bool sink_turn = false;
+  sink_turn = !sink_turn;
+  if (sink_turn) {
+    return find_deque_edge(entry, tid) || find_widest_edge(entry, tid);
+  }
+  return find_widest_edge(entry, tid) || find_deque_edge(entry, tid);
+}
+
+/**
+ * Sets @c sink_found and returns the local id of the sink node if it was
+ * found; otherwise returns (local_id)-1.
+ *
+ * @param entry The edge to process.
+ */
+local_id handle_out_edge(const struct edge_entry &entry, int tid);
+
+/**
+ * Sets @c sink_found and returns the local id of the sink node if it was
+ * found; otherwise returns (local_id)-1.
+ *
+ * @param entry The edge to process.
+ */
+local_id handle_in_edge(const struct edge_entry &entry, int tid);
+
+/**
+ * Returns @c true if @p curr_idx is the sink node and we successfully set its
+ * label, or if setting the label joined the two trees of a bidirectional
+ * search and we set the label of the local sink node.
+ *
+ * @param edge_idx The index of the edge between the two nodes, in the
+ *                 @c out_edges list of its "from" node.
+ * @param prev_branch The @c branch of the previous node's label
+ */
+bool set_label(global_id prev_node, int prev_rank, local_id prev_idx,
+               local_id curr_idx, int value, unsigned int edge_idx,
+               global_id prev_branch, int tid);
+
+/**
+ * Handles an edge queued by the search from the sink. Returns the local id of
+ * the sink node if its label was set; otherwise returns (local_id)-1.
+ *
+ * @param entry The edge to process.
+ */
+local_id handle_sink_edge(const struct edge_entry &entry, int tid);
+
+/**
+ * Labels the sink through @p meet_idx, which has both a label and a sink
+ * label, so the path through it can be augmented. Returns @c true if the sink
+ * node is local and we set its label.
+ *
+ * Neither search expands a node that has both labels, so the two halves of the
+ * path can't share any node but @p meet_idx.
+ */
+bool join_search_trees(local_id meet_idx, int tid);
+
+/**
+ * Sets the sink label of @p curr_idx if it was unset. Returns @c true if that
+ * joined the two search trees, and we set the label of the local sink node.
+ *
+ * @param next_node The node after @p curr_idx on the path to the sink
+ * @param edge_idx The index of the edge between the two nodes, in the
+ *                 @c out_edges list of its "from" node.
+ */
+bool set_sink_label(global_id next_node, int next_rank, local_id next_idx,
+                    local_id curr_idx, int value, unsigned int edge_idx,
+                    int tid);
+
+/**
+ * Handles a single labelling message from a batch. A SET_TO_LABEL message
+ * without an edge index labels the sink through the node where the two trees
+ * of a bidirectional search met.
+ *
+ * Returns the local id of the sink node if its label was set; otherwise
+ * returns (local_id)-1.
+ *
+ * @param sender The rank that sent the message.
+ */
+local_id handle_label_message(int tag, const struct message_data &msg,
+                              int sender, int tid) {
+  local_id vert_idx = lookup_global_id(msg.receivers_node);
+  if (vert_idx == (local_id)-1) {
+    ERROR("%s sent to wrong rank", tag2str(tag));
+    return -1;
+  }
+  if (msg.pass != pass) {
+    ERROR("***** Got old message! *****");
+    return -1;
+  }
+  int value = msg.value;
+  if (tag == SET_SINK_LABEL || tag == COMPUTE_SINK_LABEL) {
+    if (tag == COMPUTE_SINK_LABEL) {
+      // get the residual capacity of the edge to the sender's node
+      const struct out_edge &edge =
+          vertices[vert_idx].out_edges[msg.edge_index];
+      int flow_diff = edge.capacity - edge.flow;
+      if (flow_diff < scaling_delta) {
+        return -1; // discard edge
+      }
+      value = min(abs(msg.value), flow_diff);
+    }
+    if (set_sink_label(msg.senders_node, sender, -1, vert_idx, value,
+                       msg.edge_index, tid)) {
+      return lookup_global_id(sink_id);
+    }
+    return -1;
+  }
+  // the sender has a label, so it doesn't need one from us
+  local_id slot = border_slots.find(msg.senders_node);
+  if (slot != (local_id)-1) {
+    __atomic_store_n(&border_labelled_pass[slot], pass, __ATOMIC_RELAXED);
+  }
+  if (set_label(msg.senders_node, sender, -1, vert_idx, value, msg.edge_index,
+                msg.branch, tid)) {
+    // found sink!
+    if (value < 0 && vertices[vert_idx].id == sink_id) {
+      ERROR("outgoing edge from sink!");
+    }
+    return lookup_global_id(sink_id);
+  }
+  return -1;
+}
+
+/// If more than 1 in this many nodes were labelled, clear_labels() clears the
+/// whole label array instead of visiting the labelled nodes one by one
+#define LABEL_RESET_FILL_RATIO 8
+
+/**
+ * Wipes every label in @p tree, given the per-thread lists of the nodes that
+ * were labelled, and empties the lists.
+ */
+void clear_labels(vector<struct label> &tree,
+                  vector<vector<local_id>> &labelled) {
+  size_t total = 0;
+  for (size_t t = 0; t < labelled.size(); ++t) {
+    total += labelled[t].size();
+  }
+  if (total > tree.size() / LABEL_RESET_FILL_RATIO) {
+    fill(tree.begin(), tree.end(), EMPTY_LABEL);
+  } else {
+    for (size_t t = 0; t < labelled.size(); ++t) {
+      for (size_t i = 0; i < labelled[t].size(); ++i) {
+        tree[labelled[t][i]] = EMPTY_LABEL;
+      }
+    }
+  }
+  for (size_t t = 0; t < labelled.size(); ++t) {
+    labelled[t].clear();
+  }
+}
+
+/**
+ * Wipes the labels set in earlier passes, except for those that are still
+ * valid.
+ *
+ * Augmenting a path only changes the residual capacities of its edges, and
+ * every one of them is in the subtree of the search tree under the first node
+ * after the source. The labels outside that subtree still describe valid
+ * paths from the source, so the search tree is kept apart from that subtree.
+ *
+ * @param branch The first node after the source on the last augmenting path,
+ *               or @c (global_id)-1 to wipe every label
+ * @param wiped Gets the local nodes whose labels were wiped, unless every
+ *              label was
+ */
+void reset_labels(global_id branch, vector<local_id> &wiped) {
+  if (branch == (global_id)-1) {
+    clear_labels(labels, labelled_nodes);
+    return;
+  }
+
+  for (size_t t = 0; t < labelled_nodes.size(); ++t) {
+    vector<local_id> &nodes = labelled_nodes[t];
+    size_t kept = 0;
+    for (size_t i = 0; i < nodes.size(); ++i) {
+      if (labels[nodes[i]].branch == branch) {
+        labels[nodes[i]] = EMPTY_LABEL;
+        wiped.push_back(nodes[i]);
+      } else {
+        nodes[kept++] = nodes[i];
+      }
+    }
+    nodes.resize(kept);
+  }
+}
+
+/**
+ * Finds the first node after the source on the augmenting path found in the
+ * last pass, from the label of the sink. Must be called by every rank at once.
+ *
+ * @return The node's global ID, or @c (global_id)-1 if no path was found
+ */
+global_id find_last_branch() {
+  global_id local_branch = -1;
+  local_id sink_idx = lookup_global_id(sink_id);
+  if (sink_idx != (local_id)-1 && labels[sink_idx].value != 0) {
+    local_branch = labels[sink_idx].branch;
+  }
+  global_id branch = -1;
+  MPI_Allreduce(&local_branch, &branch, 1, GLOBAL_ID_TYPE, MPI_MIN,
+                MPI_COMM_WORLD);
+  return branch;
+}
+
+/**
+ * Asks the ranks holding the border nodes that were marked as labelled in the
+ * last pass, and that a kept label has an edge to, whether they still are.
+ * Their labels may have been wiped, or the label message may have been
+ * dropped when the pass ended. The marks of the nodes that are still labelled
+ * are carried over to this pass. Must be called by thread 0 on every rank at
+ * once.
+ *
+ * @param lost Gets the border slots of the nodes that are no longer labelled
+ */
+void check_border_labels(vector<size_t> &lost) {
+  vector<vector<size_t>> asked(mpi_size);
+  for (size_t s = 0; s < border_ids.size(); ++s) {
+    if (border_labelled_pass[s] != pass - 1) {
+      continue;
+    }
+    bool kept_neighbor = false;
+    for (size_t e = border_edge_offsets[s];
+         e < border_edge_offsets[s + 1] && !kept_neighbor; ++e) {
+      kept_neighbor = labels[border_edges[e].vertex_index].value != 0;
+    }
+    if (kept_neighbor) {
+      asked[border_slot_ranks[s]].push_back(s);
+    }
+  }
+  vector<int> send_counts(mpi_size, 0);
+  vector<struct message_data> send_buffer;
+  for (int r = 0; r < mpi_size; ++r) {
+    send_counts[r] = asked[r].size();
+    for (size_t i = 0; i < asked[r].size(); ++i) {
+      struct message_data msg = {};
+      msg.receivers_node = border_ids[asked[r][i]];
+      msg.pass = pass;
+      send_buffer.push_back(msg);
+    }
+  }
+  vector<int> recv_counts;
+  vector<struct message_data> recv_buffer;
+  exchange_messages(send_counts, 1, send_buffer, recv_counts, recv_buffer);
+
+  // answer with the nodes that have lost their labels
+  send_counts.assign(mpi_size, 0);
+  send_buffer.clear();
+  size_t k = 0;
+  for (int r = 0; r < mpi_size; ++r) {
+    for (int i = 0; i < recv_counts[r]; ++i, ++k) {
+      local_id idx = lookup_global_id(recv_buffer[k].receivers_node);
+      if (idx != (local_id)-1 && labels[idx].value == 0) {
+        send_buffer.push_back(recv_buffer[k]);
+        send_counts[r]++;
+      }
+    }
+  }
+  exchange_messages(send_counts, 1, send_buffer, recv_counts, recv_buffer);
+
+  for (int r = 0; r < mpi_size; ++r) {
+    for (size_t i = 0; i < asked[r].size(); ++i) {
+      border_labelled_pass[asked[r][i]] = pass;
+    }
+  }
+  for (size_t i = 0; i < recv_buffer.size(); ++i) {
+    size_t slot = border_slots.find(recv_buffer[i].receivers_node);
+    border_labelled_pass[slot] = 0;
+    lost.push_back(slot);
+  }
+}
+
+/**
+ * Per edge, whether resume_search() has queued it yet, so that an edge found
+ * in more than one way isn't queued twice, and then left over again. Holds the
+ * out-edges, then the in-edges.
+ */
+vector<char> edge_requeued;
+/// The entries set in @c edge_requeued, cleared by resume_search() when done
+vector<size_t> requeued_edges;
+
+/**
+ * Queues an edge of a local node for resume_search(), if the node is labelled
+ * and the edge isn't queued already.
+ */
+void requeue_edge(const struct edge_entry &entry, bool skip_local, int tid) {
+  local_id v = entry.vertex_index;
+  if (labels[v].value == 0) {
+    return;
+  }
+  size_t pos = entry.is_outgoing
+                   ? vertices.out_edge_offset(v) + entry.edge_index
+                   : out_border_slot.size() + vertices.in_edge_offset(v) +
+                         entry.edge_index;
+  if (edge_requeued[pos]) {
+    return;
+  }
+  edge_requeued[pos] = true;
+  requeued_edges.push_back(pos);
+  const struct vertex &vert = vertices[v];
+  if (entry.is_outgoing) {
+    queue_out_edges(vert, v, entry.edge_index, entry.edge_index + 1, false,
+                    skip_local, tid);
+  } else {
+    queue_in_edges(vert, v, entry.edge_index, entry.edge_index + 1, false,
+                   skip_local, tid);
+  }
+}
+
+/**
+ * Queues the edges from kept local nodes to the local nodes in the wiped
+ * subtree, for resume_search(). They are found from whichever side has fewer
+ * nodes.
+ */
+void requeue_wiped_neighbors(const vector<local_id> &wiped, int tid) {
+  size_t kept = 0;
+  for (size_t t = 0; t < labelled_nodes.size(); ++t) {
+    kept += labelled_nodes[t].size();
+  }
+  if (kept < wiped.size()) {
+    for (size_t t = 0; t < labelled_nodes.size(); ++t) {
+      for (size_t k = 0; k < labelled_nodes[t].size(); ++k) {
+        local_id v = labelled_nodes[t][k];
+        const struct vertex vert = vertices[v];
+        for (unsigned int i = 0; i < vert.out_edges.size(); ++i) {
+          if (vert.out_edges[i].rank_location == mpi_rank) {
+            struct edge_entry entry = {v, true, false, i};
+            requeue_edge(entry, false, tid);
+          }
+        }
+        for (unsigned int i = 0; i < vert.in_edges.size(); ++i) {
+          if (vert.in_edges[i].rank_location == mpi_rank) {
+            struct edge_entry entry = {v, false, false, i};
+            requeue_edge(entry, false, tid);
+          }
+        }
+      }
+    }
+    return;
+  }
+  for (size_t k = 0; k < wiped.size(); ++k) {
+    local_id w = wiped[k];
+    const struct vertex vert = vertices[w];
+    for (unsigned int i = 0; i < vert.in_edges.size(); ++i) {
+      const struct in_edge &edge = vert.in_edges[i];
+      if (edge.rank_location == mpi_rank) {
+        struct edge_entry entry = {edge.vert_index, true, false,
+                                   edge.out_index};
+        requeue_edge(entry, false, tid);
+      }
+    }
+    for (unsigned int i = 0; i < vert.out_edges.size(); ++i) {
+      const struct out_edge &edge = vert.out_edges[i];
+      if (edge.rank_location != mpi_rank ||
+          labels[edge.vert_index].value == 0 || edge.flow < scaling_delta) {
+        continue; // the neighbor can't give the node a label through it
+      }
+      // find the matching in-edge of the neighbor
+      const struct vertex nbr = vertices[edge.vert_index];
+      for (unsigned int j = 0; j < nbr.in_edges.size(); ++j) {
+        const struct in_edge &back = nbr.in_edges[j];
+        if (back.rank_location == mpi_rank && back.vert_index == w &&
+            back.out_index == i) {
+          struct edge_entry entry = {edge.vert_index, false, false, j};
+          requeue_edge(entry, false, tid);
+          break;
+        }
+      }
+    }
+  }
+}
+
+/**
+ * Resumes the search from the labels kept by reset_labels(). The search may
+ * still have to follow the edges it hadn't explored when the sink was found,
+ * and those leading to nodes that lost their labels. Those are the edges left
+ * in the queues, plus the edges into the wiped subtree, unless it is cheaper
+ * to queue every edge of the kept nodes again. Either way, labels aren't sent
+ * again to remote nodes that still have one. Must be called by thread 0 on
+ * every rank at once, before the queues are cleared.
+ *
+ * @param wiped The local nodes whose labels were wiped
+ */
+void resume_search(const vector<local_id> &wiped, int tid) {
+  vector<size_t> lost;
+  if (mpi_size > 1) {
+    check_border_labels(lost);
+  }
+  size_t kept_edges = 0;
+  for (size_t t = 0; t < labelled_nodes.size(); ++t) {
+    for (size_t j = 0; j < labelled_nodes[t].size(); ++j) {
+      const struct vertex v = vertices[labelled_nodes[t][j]];
+      kept_edges += v.out_edges.size() + v.in_edges.size();
+    }
+  }
+  size_t queued = 0;
+  for (size_t i = 0; i < num_threads; ++i) {
+    queued += edge_deques[i].size();
+    if (edge_heaps != NULL) {
+      queued += edge_heaps[i].size();
+    }
+  }
+  // when few nodes kept their labels, queueing all their edges again is
+  // cheaper than sorting out the queued edges
+  bool rescan = kept_edges <= queued;
+  vector<struct edge_entry> unexplored;
+  for (size_t i = 0; i < num_threads; ++i) {
+    if (rescan) {
+      edge_deques[i].clear();
+    } else {
+      edge_deques[i].take_all(unexplored);
+    }
+    if (edge_heaps != NULL && rescan) {
+      edge_heaps[i].clear();
+    } else if (edge_heaps != NULL) {
+      edge_heaps[i].take_all(unexplored);
+    }
+  }
+  if (rescan) {
+    for (size_t t = 0; t < labelled_nodes.size(); ++t) {
+      for (size_t j = 0; j < labelled_nodes[t].size(); ++j) {
+        insert_edges(labelled_nodes[t][j], tid);
+      }
+    }
+    return;
+  }
+
+  edge_requeued.resize(out_border_slot.size() + in_border_slot.size(), false);
+  bool skip_local = bottom_up;
+  for (size_t i = 0; i < unexplored.size(); ++i) {
+    requeue_edge(unexplored[i], skip_local, tid);
+  }
+  for (size_t i = 0; i < lost.size(); ++i) {
+    for (size_t e = border_edge_offsets[lost[i]];
+         e < border_edge_offsets[lost[i] + 1]; ++e) {
+      requeue_edge(border_edges[e], skip_local, tid);
+    }
+  }
+  // the sweeps find the local nodes that lost their labels
+  if (!skip_local) {
+    requeue_wiped_neighbors(wiped, tid);
+  }
+  for (size_t i = 0; i < requeued_edges.size(); ++i) {
+    edge_requeued[requeued_edges[i]] = false;
+  }
+  requeued_edges.clear();
+}
+
+/**
+ * Sends a control message without waiting for it to be received, since the
+ * receiver may itself be blocked sending to this rank. The sends are completed
+ * at the end of step 3, once every rank has received all of them.
+ */
+void send_control_message(int dest, int tag, const struct message_data &msg) {
+  control_messages.push_back(msg);
+  control_requests.push_back(MPI_REQUEST_NULL);
+  MPI_Isend(&control_messages.back(), 1, MPI_MESSAGE_TYPE, dest, tag,
+            control_comm(), &control_requests.back());
+}
+
+/**
+ * Marks the sink as found on this rank, and passes SINK_FOUND on to this
+ * rank's children in a binomial tree rooted at the rank that found the sink,
+ * so every rank hears of it after log2(mpi_size) hops.
+ *
+ * @param root The rank that found the sink
+ */
+void forward_sink_found(int root, int tid) {
+  sink_found_received = true;
+  int rel = (mpi_rank - root + mpi_size) % mpi_size;
+  struct message_data msg = {};
+  msg.value = root;
+  msg.pass = pass;
+  for (int mask = 1; mask < mpi_size; mask <<= 1) {
+    if (rel < mask && rel + mask < mpi_size) {
+      int child = (root + rel + mask) % mpi_size;
+      DEBUG(1, "sending SINK_FOUND to R%d", child);
+      send_control_message(child, SINK_FOUND, msg);
+    }
+  }
+}
+
+/**
+ * Pushes @p amount of flow along the sink's half of a path found by a
+ * bidirectional search, following the sink labels from @p vert_idx. If the
+ * next node is on another rank, sends it an UPDATE_SINK_FLOW message to carry
+ * on from there.
+ *
+ * @return The local id of the sink node if it was reached, otherwise
+ *         @c (local_id)-1
+ */
+local_id push_sink_flow(local_id vert_idx, int amount, int tid) {
+  while (vertices[vert_idx].id != sink_id) {
+    const struct label &l = sink_labels[vert_idx];
+    if (l.value > 0) {
+      // let f(x, y) += amount
+      vertices[vert_idx].out_edges[l.prev_edge_index].flow += amount;
+    } else if (l.prev_rank_loc == mpi_rank) {
+      // let f(y, x) -= amount
+      vertices[l.prev_vert_index].out_edges[l.prev_edge_index].flow -= amount;
+    } else {
+      add_mirror_flow(vert_idx, l.prev_node, l.prev_edge_index, -amount, tid);
+    }
+    if (l.prev_rank_loc != mpi_rank) {
+      // the receiver holds the edge if it is a reverse edge, and its mirrored
+      // flow otherwise
+      struct message_data msg = {
+          vertices[vert_idx].id,          // sender's node
+          l.prev_node,                    // receiver's node
+          l.value > 0 ? amount : -amount, // flow to push
+          pass,                           // current pass
+          l.prev_edge_index,              // edge index
+          (global_id)-1,                  // branch (unused)
+      };
+      DEBUG(1, "S3: sending UPDATE_SINK_FLOW to R%d", l.prev_rank_loc);
+      send_control_message(l.prev_rank_loc, UPDATE_SINK_FLOW, msg);
+      return -1;
+    }
+    vert_idx = l.prev_vert_index;
+  }
+  return vert_idx;
+}
+
+/**
+ * Called by thread 0 on every rank once no path is left with residual
+ * capacities of at least @c scaling_delta. Halves @c scaling_delta and ends
+ * the pass, so every thread goes back to step 1 without doing step 3.
+ *
+ * @return @c false if this was the last phase, so the algorithm is complete
+ */
+bool start_next_scaling_phase(int tid) {
+  if (scaling_delta <= 1) {
+    return false;
+  }
+  scaling_delta /= 2;
+  DEBUG(1, "No paths left, lowering scaling delta to %d", scaling_delta);
+  __atomic_store_n(&sink_found, true, __ATOMIC_SEQ_CST);
+  return true;
+}
+
+/*********** Bottom-Up Search ***************/
+
+/**
+ * Direction-optimizing search, after Beamer et al. When the edges queued on a
+ * rank, or those of the nodes labelled in the last level, are more than
+ * 1/BOTTOM_UP_ALPHA of the unlabelled nodes' edges, the rank switches to
+ * bottom-up sweeps. It switches back once a sweep labels fewer than
+ * 1/BOTTOM_UP_BETA of its nodes. Only used with @c level_synchronous, since a
+ * sweep needs the rank to be idle.
+ */
+#define BOTTOM_UP_ALPHA 14
+#define BOTTOM_UP_BETA 24
+/// Number of nodes scanned by a worker at a time during a sweep
+#define BOTTOM_UP_CHUNK_SIZE 1024
+
+/// An unlabelled node, and the labelled neighbor it can get a label from
+struct bottom_up_parent {
+  local_id vert_idx;
+  local_id parent_idx;
+  /// The label value, which is negative if the residual edge is the reverse
+  /// of an out-edge of @c vert_idx
+  int value;
+  /// The index of the edge in the @c out_edges list of its "from" node
+  unsigned int edge_index;
+};
+
+/// The two phases of a sweep, so no node is labelled while others are checked
+enum sweep_phase { SWEEP_SCAN, SWEEP_APPLY };
+enum sweep_phase current_sweep_phase;
+/// Chunks of the current phase that no worker has taken yet
+int sweep_chunks_left = 0;
+/// Per thread: the parents found in the scan phase
+vector<vector<struct bottom_up_parent>> sweep_parents;
+
+/**
+ * Returns @c true if the local node @p idx is labelled, and can be the
+ * previous node of another. As in step 2, the sink and the nodes where the two
+ * trees of a bidirectional search met are never expanded.
+ */
+bool can_expand(local_id idx) {
+  return labels[idx].value != 0 && vertices[idx].id != sink_id &&
+         (!bidirectional_search ||
+          __atomic_load_n(&sink_labels[idx].value, __ATOMIC_SEQ_CST) == 0);
+}
+
+/**
+ * Looks for a labelled local node with a residual edge to each unlabelled
+ * node in a chunk, and keeps the first one found in this thread's
+ * @c sweep_parents.
+ */
+void scan_sweep_chunk(int chunk, int tid) {
+  local_id begin = (local_id)chunk * BOTTOM_UP_CHUNK_SIZE;
+  local_id end = min(begin + BOTTOM_UP_CHUNK_SIZE, (local_id)vertices.size());
+  for (local_id v = begin; v < end; ++v) {
+    if (labels[v].value != 0) {
+      continue;
+    }
+    const struct vertex vert = vertices[v];
+    bool found = false;
+    // an in-edge with residual capacity, like handle_out_edge()
+    for (unsigned int i = 0; i < vert.in_edges.size() && !found; ++i) {
+      const struct in_edge &edge = vert.in_edges[i];
+      if (edge.rank_location != mpi_rank || !can_expand(edge.vert_index)) {
+        continue;
+      }
+      const struct out_edge &out =
+          vertices[edge.vert_index].out_edges[edge.out_index];
+      if (out.capacity - out.flow >= scaling_delta) {
+        struct bottom_up_parent p = {
+            v, edge.vert_index,
+            min(abs(labels[edge.vert_index].value), out.capacity - out.flow),
+            edge.out_index};
+        sweep_parents[tid].push_back(p);
+        found = true;
+      }
+    }
+    // the reverse of an out-edge with flow, like handle_in_edge()
+    for (unsigned int i = 0; i < vert.out_edges.size() && !found; ++i) {
+      const struct out_edge &edge = vert.out_edges[i];
+      if (edge.rank_location != mpi_rank || !can_expand(edge.vert_index) ||
+          edge.flow < scaling_delta) {
+        continue;
+      }
+      struct bottom_up_parent p = {
+          v, edge.vert_index,
+          -min(abs(labels[edge.vert_index].value), edge.flow), i};
+      sweep_parents[tid].push_back(p);
+      found = true;
+    }
+  }
+}
+
+/**
+ * Labels the nodes found by thread @p chunk in the scan phase.
+ *
+ * @return The local id of the sink node if its label was set, otherwise
+ *         @c (local_id)-1
+ */
+local_id apply_sweep_chunk(int chunk, int tid) {
+  const vector<struct bottom_up_parent> &parents = sweep_parents[chunk];
+  for (size_t i = 0; i < parents.size(); ++i) {
+    const struct bottom_up_parent &p = parents[i];
+    if (set_label(vertices[p.parent_idx].id, mpi_rank, p.parent_idx,
+                  p.vert_idx, p.value, p.edge_index,
+                  labels[p.parent_idx].branch, tid)) {
+      return lookup_global_id(sink_id);
+    }
+  }
+  return -1;
+}
+
+/**
+ * Takes a chunk of the current sweep phase, if any are left. Called by idle
+ * worker threads.
+ */
+bool take_sweep_chunk(int &chunk) {
+  int left = __atomic_load_n(&sweep_chunks_left, __ATOMIC_ACQUIRE);
+  while (left > 0) {
+    if (__atomic_compare_exchange_n(&sweep_chunks_left, &left, left - 1, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      chunk = left - 1;
+      return true;
+    }
+  }
+  return false;
+}
+
+/// Hands @p chunks chunks of @p phase to the workers, and waits for them.
+void run_sweep_phase(enum sweep_phase phase, int chunks) {
+  current_sweep_phase = phase;
+  __sync_fetch_and_add(&pending_work, chunks);
+  __atomic_store_n(&sweep_chunks_left, chunks, __ATOMIC_SEQ_CST);
+  while (__sync_fetch_and_add(&pending_work, 0) != 0 &&
+         !__atomic_load_n(&sink_found, __ATOMIC_SEQ_CST)) {
+    sched_yield();
+  }
+}
+
+/**
+ * Runs one bottom-up step on this rank: every unlabelled local node looks for
+ * a labelled local node with a residual edge to it, and takes its label from
+ * the first one it finds. Called by thread 0 while the workers are idle.
+ *
+ * @return The number of nodes labelled. They are left in @c sweep_parents.
+ */
+size_t bottom_up_sweep(int tid) {
+  for (size_t t = 0; t < num_threads; ++t) {
+    sweep_parents[t].clear();
+  }
+  run_sweep_phase(SWEEP_SCAN, (vertices.size() + BOTTOM_UP_CHUNK_SIZE - 1) /
+                                  BOTTOM_UP_CHUNK_SIZE);
+  size_t found = 0;
+  for (size_t t = 0; t < num_threads; ++t) {
+    found += sweep_parents[t].size();
+  }
+  if (found > 0 && !__atomic_load_n(&sink_found, __ATOMIC_SEQ_CST)) {
+    run_sweep_phase(SWEEP_APPLY, num_threads);
+  }
+  DEBUG(2, "S2: bottom-up sweep labelled %lu nodes", found);
+  return found;
+}
+
+/**
+ * Adds up the edges of the nodes labelled since the last call, and moves
+ * @p marks past them. Called by thread 0 while the workers are idle.
+ */
+size_t count_new_label_edges(vector<size_t> &marks) {
+  size_t edges = 0;
+  for (size_t t = 0; t < num_threads; ++t) {
+    for (; marks[t] < labelled_nodes[t].size(); ++marks[t]) {
+      local_id v = labelled_nodes[t][marks[t]];
+      edges += vertices[v].out_edges.size() + vertices[v].in_edges.size();
+    }
+  }
+  return edges;
+}
+
+/**
+ * Returns @c true if a search with @p frontier_edges edges to follow should
+ * run bottom-up, when the unlabelled nodes have @p unlabelled_edges edges.
+ */
+bool prefer_bottom_up(size_t frontier_edges, size_t unlabelled_edges) {
+  // widest-first and guided searches need the edges in order, so they stay
+  // top-down
+  return level_synchronous && !use_edge_heaps() &&
+         frontier_edges > unlabelled_edges / BOTTOM_UP_ALPHA;
+}
+
+/**
+ * Step 2 for thread 0 if @c level_synchronous is set. The workers label nodes
+ * until they run out of work, which ends the current level on this rank. Then
+ * every rank sums up whether it found the sink and how many messages it has
+ * held back, and if neither is the case everywhere, the messages are
+ * exchanged to start the next level.
+ *
+ * Every rank leaves step 2 after the same level, so no SINK_FOUND messages or
+ * termination rounds are needed.
+ *
+ * Each rank decides on its own whether to search its part of the next level
+ * top-down or bottom-up, since the sweeps only look at local nodes.
+ *
+ * @return TERMINATION_STOPPED once some rank has found the sink, or
+ *         TERMINATION_DONE once a level ends without any messages, so no path
+ *         is left
+ */
+enum termination_result run_levels(int tid) {
+  size_t total_edges =
+      vertices.all_out_edges().size() + vertices.all_in_edges().size();
+  size_t labelled_edges = 0;
+  vector<size_t> marks(num_threads, 0);
+  while (true) {
+    // a worker that finds the sink sets sink_found before it counts its work
+    // as done, so this can't miss it
+    int work;
+    while ((work = __sync_fetch_and_add(&pending_work, 0)) != 0 &&
+           !__atomic_load_n(&sink_found, __ATOMIC_SEQ_CST)) {
+      if (!bottom_up && prefer_bottom_up(work, total_edges - labelled_edges)) {
+        // the workers drop the queued local edges, and the sweeps find
+        // where they lead
+        DEBUG(1, "S2: switching to bottom-up search");
+        __atomic_store_n(&bottom_up, true, __ATOMIC_RELAXED);
+      }
+      sched_yield();
+    }
+    if (bottom_up && !__atomic_load_n(&sink_found, __ATOMIC_SEQ_CST)) {
+      size_t found = bottom_up_sweep(tid);
+      if (found > 0 && !__atomic_load_n(&sink_found, __ATOMIC_SEQ_CST)) {
+        if (found < vertices.size() / BOTTOM_UP_BETA) {
+          // few nodes left to label, so go back to following their edges
+          DEBUG(1, "S2: switching to top-down search");
+          __atomic_store_n(&bottom_up, false, __ATOMIC_RELAXED);
+          for (size_t t = 0; t < num_threads; ++t) {
+            for (size_t i = 0; i < sweep_parents[t].size(); ++i) {
+              if (can_expand(sweep_parents[t][i].vert_idx)) {
+                insert_edges(sweep_parents[t][i].vert_idx, tid);
+              }
+            }
+          }
+        }
+        // carry on until this rank runs out of work
+        continue;
+      }
+    }
+    int local[2] = {__atomic_load_n(&sink_found, __ATOMIC_SEQ_CST) ? 1 : 0, 0};
+    // once the sink is found, the workers may still be filling the outboxes,
+    // and the count isn't needed
+    for (size_t t = 0; t < level_outboxes.size() && local[0] == 0; ++t) {
+      for (size_t i = 0; i < level_outboxes[t].size(); ++i) {
+        local[1] += level_outboxes[t][i].size();
+      }
+    }
+    int total[2] = {0, 0};
+    MPI_Allreduce(local, total, 2, MPI_INT, MPI_SUM, label_comm);
+    if (total[0] > 0) {
+      // if a worker on this rank found the sink, it does step 3; otherwise
+      // we do
+      __sync_val_compare_and_swap(&step_3_tid, -1, tid);
+      sink_found_received = true;
+      termination_state = TERMINATION_STOPPED;
+      __atomic_store_n(&sink_found, true, __ATOMIC_SEQ_CST);
+      return TERMINATION_STOPPED;
+    }
+    if (total[1] == 0) {
+      return TERMINATION_DONE;
+    }
+    size_t frontier_edges = count_new_label_edges(marks);
+    labelled_edges += frontier_edges;
+    if (!bottom_up &&
+        prefer_bottom_up(frontier_edges, total_edges - labelled_edges)) {
+      DEBUG(1, "S2: switching to bottom-up search");
+      __atomic_store_n(&bottom_up, true, __ATOMIC_RELAXED);
+    }
+    exchange_level_messages(tid);
+  }
+}
+
+void *run_algorithm(struct thread_params *params) {
+  int tid = params->tid;
+  Barrier &barrier = params->barrier;
+
+  while (!algorithm_complete) {
+    // synchronize all threads before each iteration
+    barrier.wait();
+
+    /*--------*
+     | Step 1 |
+     *--------*/
+    if (tid == 0) {
+      // the sink's half of the last path may run through any subtree, so a
+      // bidirectional search always starts from scratch
+      global_id branch =
+          bidirectional_search ? (global_id)-1 : find_last_branch();
+      bool warm_start = branch != (global_id)-1;
+      vector<local_id> wiped;
+      reset_labels(branch, wiped);
+      if (bidirectional_search) {
+        clear_labels(sink_labels, sink_labelled_nodes);
+      }
+      // setup globals
+      pending_work = 0;
+      sink_found = false;
+      sink_found_received = false;
+      early_update_tag = 0;
+      step_3_tid = -1;
+      // if the last pass ended bottom-up, its local frontier isn't queued
+      bool ended_bottom_up = bottom_up;
+      bottom_up = false;
+      sweep_chunks_left = 0;
+
+      // empty out edge deques, unless the search resumes from them
+      if (!warm_start) {
+        for (size_t i = 0; i < num_threads; ++i) {
+          edge_deques[i].clear();
+          if (edge_heaps != NULL) {
+            edge_heaps[i].clear();
+          }
+        }
+      }
+      // drop any labelling messages that weren't sent last pass
+      for (int i = 0; i < LABEL_TAG_COUNT * mpi_size; ++i) {
+        label_batches[i].messages.clear();
+      }
+      for (size_t t = 0; t < level_outboxes.size(); ++t) {
+        for (int i = 0; i < LABEL_TAG_COUNT * mpi_size; ++i) {
+          level_outboxes[t][i].clear();
+        }
+      }
+      next_flush_time = 0;
+      reset_label_comm();
+      DEBUG(1, "Pass %d:", pass);
+      if (guided_search &&
+          (sink_distance_pass == 0 ||
+           pass - sink_distance_pass >= SINK_DISTANCE_REFRESH_PASSES ||
+           scaling_delta != sink_distance_delta)) {
+        compute_sink_distances(tid);
+      }
+      if (warm_start) {
+        // resume the search from the nodes that kept their labels
+        bottom_up = level_synchronous && ended_bottom_up;
+        resume_search(wiped, tid);
+        DEBUG(1, "S1: resuming the search from %d edges", pending_work);
+        if (level_synchronous && !bottom_up) {
+          // if many nodes kept their labels, it may be cheaper for the others
+          // to look for them than to follow the queued edges
+          vector<size_t> marks(num_threads, 0);
+          size_t kept_edges = count_new_label_edges(marks);
+          size_t total_edges =
+              vertices.all_out_edges().size() + vertices.all_in_edges().size();
+          bottom_up = prefer_bottom_up(pending_work, total_edges - kept_edges);
+        }
+      }
+      // find source node
+      local_id i = lookup_global_id(source_id);
+      if (i != (local_id)-1 && labels[i].value == 0) {
+        set_label(source_id, mpi_rank, i, i,
+                  numeric_limits<decltype(labels[i].value)>::max(), -1,
+                  (global_id)-1, tid);
+      }
+      // and the sink node, for the search going the other way
+      if (bidirectional_search && sink_rank == mpi_rank) {
+        local_id j = lookup_global_id(sink_id);
+        set_sink_label(sink_id, mpi_rank, j, j,
+                       numeric_limits<decltype(labels[j].value)>::max(), -1,
+                       tid);
+      }
+    }
+
+    /**
+     * In step 3, holds the local index of the node that the backtracking
+     * algorithm is currently processing. Local to each thread.
+     *
+     * Set to @c (local_id)-1 if the current backtracking node is not on this
+     * rank.
+     */
+    local_id bt_idx = -1;
+    /// Label value of sink node
+    int sink_value = 0;
+
+    // all threads must wait until everything is initialized
+    barrier.wait();
+    if (tid == 0) {
+      DEBUG(1, "------------------ START STEP 2 ------------------");
+    }
+
+    /*--------*
+     | Step 2 |
+     *--------*/
+    // Thread 0 drives communication: it hands received labelling batches to
+    // the worker threads and handles control messages, while the other
+    // threads run the actual algorithm
+    if (tid == 0 && level_synchronous) {
+      if (run_levels(tid) == TERMINATION_DONE &&
+          !start_next_scaling_phase(tid)) {
+        DEBUG(1, "Algorithm complete!");
+        delete params;
+        algorithm_complete = true;
+        return NULL;
+      }
+    } else if (tid == 0) {
+      struct message_data msg = {};
+
+      while (!__atomic_load_n(&sink_found, __ATOMIC_SEQ_CST)) {
+        progress_label_comm(tid);
+        if (poll_termination(false) == TERMINATION_DONE) {
+          if (start_next_scaling_phase(tid)) {
+            break;
+          }
+          DEBUG(1, "Algorithm complete!");
+          delete params;
+          algorithm_complete = true;
+          return NULL;
+        }
+        MPI_Status stat;
+        int flag = 0;
+        MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, control_comm(), &flag, &stat);
+        if (!flag) {
+          // leave the core to the worker threads if they need it
+          sched_yield();
+          continue;
+        }
+        MPI_Recv(&msg, 1, MPI_MESSAGE_TYPE, stat.MPI_SOURCE, stat.MPI_TAG,
+                 control_comm(), &stat);
+        DEBUG(2, "S2: got msg %s from R%d", tag2str(stat.MPI_TAG),
+              stat.MPI_SOURCE);
+        switch (stat.MPI_TAG) {
+        case SINK_FOUND: {
+          forward_sink_found(msg.value, tid);
+          // if a worker on this rank found the sink, it does step 3;
+          // otherwise we do
+          DEBUG(1, "Setting step_3_tid from SINK_FOUND...");
+          int old_val = __sync_val_compare_and_swap(&step_3_tid, -1, tid);
+          if (old_val == -1) {
+            DEBUG(1, "We will handle step 3");
+          } else {
+            DEBUG(1, "Thread %d is handling step 3", old_val);
+          }
+          sink_found = true;
+        } break;
+        case UPDATE_FLOW:
+        case UPDATE_SINK_FLOW:
+          // step 3 reached this rank before SINK_FOUND did, so keep the
+          // message until every thread has stopped
+          DEBUG(1, "S2: got %s early", tag2str(stat.MPI_TAG));
+          early_update = msg;
+          early_update_tag = stat.MPI_TAG;
+          __sync_val_compare_and_swap(&step_3_tid, -1, tid);
+          sink_found = true;
+          break;
+        default:
+          ERROR("got invalid tag in step 2: %s", tag2str(stat.MPI_TAG));
+          break;
+        }
+      }
+    } else {
+      struct edge_entry entry = {0, false, false, 0};
+      struct received_batch batch;
+      // sink_found and algorithm_complete are set by other threads, so they
+      // must be reloaded every time
+      while (!__atomic_load_n(&sink_found, __ATOMIC_SEQ_CST)) {
+        // handle received batches first, so they don't pile up
+        bool got_batch = take_received_batch(batch);
+        bool got_edge = !got_batch && find_edge(entry, tid);
+        int chunk = 0;
+        if (!got_batch && !got_edge && !take_sweep_chunk(chunk)) {
+          if (__atomic_load_n(&algorithm_complete, __ATOMIC_SEQ_CST)) {
+            DEBUG(1, "Algorithm complete!");
+            delete params;
+            return NULL;
+          }
+          // nothing left to do locally, so don't hold on to any messages, and
+          // help thread 0 pick up incoming batches
+          if (!level_synchronous) {
+            flush_label_batches(numeric_limits<double>::infinity(), tid);
+            progress_label_comm(tid);
+          }
+          sched_yield();
+          continue;
+        }
+
+        if (__atomic_load_n(&sink_found, __ATOMIC_SEQ_CST)) {
+          if (got_batch) {
+            recycle_batch_buffer(batch.messages);
+          }
+          __sync_fetch_and_sub(&pending_work, 1);
+          break;
+        }
+
+        if (got_batch) {
+          // set labels from another rank; stop early if we reach the sink
+          for (size_t i = 0; i < batch.messages.size(); ++i) {
+            bt_idx = handle_label_message(batch.tag, batch.messages[i],
+                                          batch.source, tid);
+            if (bt_idx != (local_id)-1) {
+              break;
+            }
+          }
+          recycle_batch_buffer(batch.messages);
+        } else if (!got_edge) {
+          if (current_sweep_phase == SWEEP_SCAN) {
+            scan_sweep_chunk(chunk, tid);
+          } else {
+            bt_idx = apply_sweep_chunk(chunk, tid);
+          }
+        } else if (entry.reverse_search) {
+          bt_idx = handle_sink_edge(entry, tid);
+        } else if (entry.is_outgoing) {
+          bt_idx = handle_out_edge(entry, tid);
+        } else {
+          bt_idx = handle_in_edge(entry, tid);
+        }
+        if (bt_idx != (local_id)-1) {
+          DEBUG(1, "Found sink node!");
+          DEBUG(1, "Setting step_3_tid from worker thread...");
+          int old_val = __sync_val_compare_and_swap(&step_3_tid, -1, tid);
+          if (old_val != -1) {
+            ERROR("Thread %d set step_3_tid, but we have bt_idx!", old_val);
+          }
+          // tell thread 0 that the sink was found, to make sure it stops
+          // before we start step 3. It will pass the message on to the other
+          // ranks, and set sink_found so the other worker threads stop too.
+          // Between levels, thread 0 checks sink_found itself.
+          if (!level_synchronous) {
+            DEBUG(1, "S2: sending msg SINK_FOUND to R%d (self)", mpi_rank);
+            struct message_data msg = {};
+            msg.value = mpi_rank;
+            msg.pass = pass;
+            MPI_Ssend(&msg, 1, MPI_MESSAGE_TYPE, mpi_rank, SINK_FOUND,
+                      control_comm());
+          }
+          __atomic_store_n(&sink_found, true, __ATOMIC_SEQ_CST);
+          __sync_fetch_and_sub(&pending_work, 1);
+          break;
+        }
+        // any edges added while processing this one were already counted in
+        // insert_edges, so pending_work can't reach 0 too early
+        __sync_fetch_and_sub(&pending_work, 1);
+        flush_stale_label_batches(tid);
+      }
+    }
+
+    // make sure all threads finish step 2
+    barrier.wait();
+
+    if (__sync_fetch_and_add(&step_3_tid, 0) == -1) {
+      // a new scaling phase was started, so there is no step 3. The pass only
+      // changes once no thread is receiving, so batches that other ranks send
+      // in the next pass aren't taken for this one.
+      if (tid == 0) {
+        pass++;
+      }
+      continue;
+    }
+
+    /*--------*
+     | Step 3 |
+     *--------*/
+    // go to the beginning of the loop and wait if not handling step 3.
+    if (__sync_fetch_and_add(&step_3_tid, 0) != tid) {
+      DEBUG(1, "returning to wait for step 3 to finish");
+      continue;
+    }
+
+    DEBUG(1, "");
+    DEBUG(1, "After step 2:");
+    // dump_labels();
+
+    if (bt_idx != (local_id)-1) {
+      // we found the sink
+      sink_value = labels[bt_idx].value;
+    }
+
+    // the other ranks may still be in step 2; they are told that the sink was
+    // found through the SINK_FOUND tree, or by the path's UPDATE_FLOW message,
+    // whichever reaches them first
+    DEBUG(1, "================== START STEP 3 ==================");
+    DEBUG(1, "My bt_idx is %ld", (ssize_t)bt_idx);
+
+    // if the sink was labelled through the node where the two trees of a
+    // bidirectional search met, push the flow along the sink's half of the
+    // path first. Backtracking carries on from the sink once that is done.
+    if (bt_idx != (local_id)-1 &&
+        labels[bt_idx].prev_edge_index == (unsigned int)-1) {
+      const struct label &l = labels[bt_idx];
+      if (l.prev_rank_loc == mpi_rank) {
+        bt_idx = push_sink_flow(l.prev_vert_index, sink_value, tid);
+      } else {
+        struct message_data msg = {
+            sink_id,          // sender's node
+            l.prev_node,      // receiver's node
+            sink_value,       // flow to push
+            pass,             // current pass
+            (unsigned int)-1, // edge index (none)
+            (global_id)-1,    // branch (unused)
+        };
+        DEBUG(1, "S3: sending UPDATE_SINK_FLOW to R%d", l.prev_rank_loc);
+        send_control_message(l.prev_rank_loc, UPDATE_SINK_FLOW, msg);
+        bt_idx = -1;
+      }
+    }
+
+    // start backtracking. A rank is done once it has been told that the sink
+    // was found, the termination rounds have stopped and, if it owns the
+    // source, the path has reached the source. Then it enters a non-blocking
+    // barrier, and keeps handling messages until every rank has entered it.
+    bool path_done = source_rank != mpi_rank;
+    MPI_Request step_3_barrier = MPI_REQUEST_NULL;
+    bool in_barrier = false;
+    while (true) {
+      if (bt_idx != (local_id)-1) {
+        // update flow in local nodes
+        struct label &l = labels[bt_idx];
+        DEBUG(1, "S3: processing node %llu", vertices[bt_idx].id);
+        if (l.value > 0 && l.prev_edge_index != (unsigned int)-1) {
+          // bt_idx is a "to" node
+          // let f(y, x) += sink_value
+          if (l.prev_rank_loc == mpi_rank) {
+            vertices[l.prev_vert_index].out_edges[l.prev_edge_index].flow +=
+                sink_value;
+          } else {
+            add_mirror_flow(bt_idx, l.prev_node, l.prev_edge_index,
+                            sink_value, tid);
+          }
+        } else if (l.value < 0) {
+          // let f(x, y) -= sink_value
+          vertices[bt_idx].out_edges[l.prev_edge_index].flow -= sink_value;
+        }
+
+        // if the previous node is not on this rank, send the next rank an
+        // UPDATE_FLOW message, then wait for incoming messages
+        if (l.prev_rank_loc != mpi_rank) {
+          // previous node is remote, send an UPDATE_FLOW message
+          // the receiver holds the edge if it is a forward edge, and its
+          // mirrored flow otherwise
+          struct message_data msg = {
+              vertices[bt_idx].id,                    // sender's node
+              l.prev_node,                            // receiver's node
+              l.value > 0 ? sink_value : -sink_value, // flow to push
+              pass,                                   // current pass
+              l.prev_edge_index,                      // edge index
+              (global_id)-1,                          // branch (unused)
+          };
+          DEBUG(1, "S3: sending UPDATE_FLOW to R%d", l.prev_rank_loc);
+          send_control_message(l.prev_rank_loc, UPDATE_FLOW, msg);
+          bt_idx = -1;
+        } else if (bt_idx == l.prev_vert_index && l.prev_node == source_id) {
+          // source node was already processed
+          DEBUG(1, "S3: reached the source");
+          path_done = true;
+          bt_idx = -1;
+        } else {
+          // otherwise, keep following back-pointers
+          bt_idx = l.prev_vert_index;
+        }
+        continue;
+      }
+
+      // the other ranks may be waiting for us to join a termination round
+      bool rounds_done = poll_termination(true) != TERMINATION_UNKNOWN;
+      if (!in_barrier && path_done && sink_found_received && rounds_done) {
+        DEBUG(1, "S3: entering barrier");
+        MPI_Ibarrier(control_comm(), &step_3_barrier);
+        in_barrier = true;
+      }
+      if (in_barrier) {
+        int done = 0;
+        MPI_Test(&step_3_barrier, &done, MPI_STATUS_IGNORE);
+        if (done) {
+          break;
+        }
+      }
+
+      // handle incoming messages, starting with one received during step 2
+      struct message_data msg = {};
+      MPI_Status stat;
+      if (early_update_tag != 0) {
+        msg = early_update;
+        stat.MPI_TAG = early_update_tag;
+        stat.MPI_SOURCE = -1;
+        early_update_tag = 0;
+      } else {
+        int flag = 0;
+        MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, control_comm(), &flag, &stat);
+        if (!flag) {
+          continue;
+        }
+        MPI_Recv(&msg, 1, MPI_MESSAGE_TYPE, stat.MPI_SOURCE, stat.MPI_TAG,
+                 control_comm(), &stat);
+      }
+      DEBUG(1, "S3: got msg %s from R%d", tag2str(stat.MPI_TAG),
+            stat.MPI_SOURCE);
+      switch (stat.MPI_TAG) {
+      case SINK_FOUND:
+        forward_sink_found(msg.value, tid);
+        break;
+      case UPDATE_FLOW: {
+        // find our local node
+        sink_value = abs(msg.value);
+        local_id vert_idx = lookup_global_id(msg.receivers_node);
+        // if there is no edge index, then the sink was labelled through
+        // vert_idx and there is no edge to update
+        if (msg.edge_index != (unsigned int)-1) {
+          if (msg.value > 0) {
+            vertices[vert_idx].out_edges[msg.edge_index].flow += sink_value;
+          } else {
+            // vert_idx is the "to" node of the edge
+            add_mirror_flow(vert_idx, msg.senders_node, msg.edge_index,
+                            -sink_value, tid);
+          }
+        }
+        bt_idx = vert_idx; // continue with the previous node
+      } break;
+      case UPDATE_SINK_FLOW: {
+        sink_value = abs(msg.value);
+        local_id vert_idx = lookup_global_id(msg.receivers_node);
+        // if there is no edge index, then the flow starts at the node
+        // where the two search trees met
+        if (msg.edge_index != (unsigned int)-1) {
+          if (msg.value < 0) {
+            // a reverse edge held by us
+            vertices[vert_idx].out_edges[msg.edge_index].flow -= sink_value;
+          } else {
+            // vert_idx is the "to" node of the edge
+            add_mirror_flow(vert_idx, msg.senders_node, msg.edge_index,
+                            sink_value, tid);
+          }
+        }
+        // backtracking starts once the flow reaches the sink
+        bt_idx = push_sink_flow(vert_idx, sink_value, tid);
+      } break;
+      default:
+        ERROR("got invalid message during step 3 with tag %s",
+              tag2str(stat.MPI_TAG));
+        break;
+      }
+    }
+
+    // every rank has received our messages by now
+    MPI_Waitall(control_requests.size(), control_requests.data(),
+                MPI_STATUSES_IGNORE);
+    control_requests.clear();
+    control_messages.clear();
+    DEBUG(1, "=================== END STEP 3 ===================");
+
+    DEBUG(1, "After step 3:");
+    // dump_flows();
+    DEBUG(1, "");
+    pass++;
+  }
+
+  delete params;
+  return NULL;
+}
+
+bool set_label(global_id prev_node, int prev_rank, local_id prev_idx,
+               local_id curr_idx, int value, unsigned int edge_idx,
+               global_id prev_branch, int tid) {
+  // atomically set label, only if it was unset before
+  if (__sync_bool_compare_and_swap(&labels[curr_idx].value, 0, value)) {
+    // label was unset before, so go ahead and set prev pointer
+    labels[curr_idx].prev_node = prev_node;
+    labels[curr_idx].prev_rank_loc = prev_rank;
+    labels[curr_idx].prev_vert_index = prev_idx;
+    labels[curr_idx].prev_edge_index = edge_idx;
+    labels[curr_idx].branch =
+        prev_node == source_id ? vertices[curr_idx].id : prev_branch;
+    labelled_nodes[tid].push_back(curr_idx);
+    if (vertices[curr_idx].id == sink_id) {
+      return true;
+    } else if (bidirectional_search &&
+               __atomic_load_n(&sink_labels[curr_idx].value,
+                               __ATOMIC_SEQ_CST) != 0) {
+      return join_search_trees(curr_idx, tid);
+    } else {
+      // add edges to queue
+      insert_edges(curr_idx, tid);
+    }
+  }
+  return false;
+}
+
+bool set_sink_label(global_id next_node, int next_rank, local_id next_idx,
+                    local_id curr_idx, int value, unsigned int edge_idx,
+                    int tid) {
+  if (__sync_bool_compare_and_swap(&sink_labels[curr_idx].value, 0, value)) {
+    sink_labels[curr_idx].prev_node = next_node;
+    sink_labels[curr_idx].prev_rank_loc = next_rank;
+    sink_labels[curr_idx].prev_vert_index = next_idx;
+    sink_labels[curr_idx].prev_edge_index = edge_idx;
+    sink_labelled_nodes[tid].push_back(curr_idx);
+    // both labels are set with a full barrier before checking the other one,
+    // so at least one of the two threads sees that the trees met
+    if (__atomic_load_n(&labels[curr_idx].value, __ATOMIC_SEQ_CST) != 0) {
+      return join_search_trees(curr_idx, tid);
+    }
+    insert_edges(curr_idx, tid, true);
+  }
+  return false;
+}
+
+bool join_search_trees(local_id meet_idx, int tid) {
+  int value =
+      min(abs(labels[meet_idx].value), abs(sink_labels[meet_idx].value));
+  DEBUG(1, "Search trees met at node %llu", vertices[meet_idx].id);
+  if (sink_rank == mpi_rank) {
+    return set_label(vertices[meet_idx].id, mpi_rank, meet_idx,
+                     lookup_global_id(sink_id), value, -1,
+                     labels[meet_idx].branch, tid);
+  }
+  // no edge index, since the sink isn't a neighbor
+  struct message_data msg = {
+      vertices[meet_idx].id,   // sender's node
+      sink_id,                 // receiver's node
+      value,                   // label value
+      pass,                    // current pass
+      (unsigned int)-1,        // edge index (none)
+      labels[meet_idx].branch, // sender's branch
+  };
+  queue_label_message(sink_rank, SET_TO_LABEL, msg, tid);
+  return false;
+}
+
+local_id handle_out_edge(const struct edge_entry &entry, int tid) {
+  local_id from_id = entry.vertex_index;
+  struct out_edge &edge = vertices[from_id].out_edges[entry.edge_index];
+
+  // always compute label locally
+  int flow_diff = edge.capacity - edge.flow;
+  if (flow_diff < scaling_delta) {
+    return -1; // discard edge
+  }
+
+  int label_val = min(abs(labels[from_id].value), flow_diff);
+  // check if "to" node is on another rank
+  if (edge.rank_location == mpi_rank) {
+    if (__atomic_load_n(&bottom_up, __ATOMIC_RELAXED)) {
+      return -1; // left to the next bottom-up sweep
+    }
+    // set label and add edges
+    if (set_label(vertices[from_id].id, mpi_rank, from_id, edge.vert_index,
+                  label_val, entry.edge_index, labels[from_id].branch, tid)) {
+      return lookup_global_id(sink_id);
+    }
+  } else if (claim_border_label(
+                 out_border_slot[vertices.out_edge_offset(from_id) +
+                                 entry.edge_index])) {
+    // send message to the owner of the "to" node
+    struct message_data msg = {
+        vertices[from_id].id,   // sender's node
+        edge.dest_node_id,      // receiver's node
+        label_val,              // label value
+        pass,                   // current pass
+        entry.edge_index,       // edge index
+        labels[from_id].branch, // sender's branch
+    };
+    queue_label_message(edge.rank_location, SET_TO_LABEL, msg, tid);
+  }
+  return -1;
+}
+
+local_id handle_in_edge(const struct edge_entry &entry, int tid) {
+  local_id to_id = entry.vertex_index;
+  struct in_edge &rev_edge = vertices[to_id].in_edges[entry.edge_index];
+
+  int curr_flow = in_edge_flow(to_id, entry.edge_index);
+  if (curr_flow < scaling_delta) {
+    return -1; // discard edge
+  }
+  int label_val = -min(abs(labels[to_id].value), curr_flow);
+
+  // check if "from" node is on another rank
+  if (rev_edge.rank_location == mpi_rank) {
+    if (__atomic_load_n(&bottom_up, __ATOMIC_RELAXED)) {
+      return -1; // left to the next bottom-up sweep
+    }
+    local_id from_id = rev_edge.vert_index;
+    // set label and add edges
+    if (set_label(vertices[to_id].id, mpi_rank, to_id, from_id, label_val,
+                  rev_edge.out_index, labels[to_id].branch, tid)) {
+      if (vertices[from_id].id == sink_id) {
+        ERROR("outgoing edge from sink!");
+      }
+      return lookup_global_id(sink_id);
+    }
+  } else if (claim_border_label(
+                 in_border_slot[vertices.in_edge_offset(to_id) +
+                                entry.edge_index])) {
+    // send message to the owner of the "from" node
+    struct message_data msg = {
+        vertices[to_id].id,    // sender's node
+        rev_edge.dest_node_id, // receiver's node
+        label_val,             // label value
+        pass,                  // current pass
+        rev_edge.out_index,    // edge index
+        labels[to_id].branch,  // sender's branch
+    };
+    queue_label_message(rev_edge.rank_location, SET_TO_LABEL, msg, tid);
+  }
+  return -1;
+}
+
+local_id handle_sink_edge(const struct edge_entry &entry, int tid) {
+  local_id to_id = entry.vertex_index;
+  int sink_label_val = abs(sink_labels[to_id].value);
+  if (entry.is_outgoing) {
+    // the reverse of an edge with flow leads to this node
+    struct out_edge &edge = vertices[to_id].out_edges[entry.edge_index];
+    if (edge.flow < scaling_delta) {
+      return -1; // discard edge
+    }
+    int label_val = -min(sink_label_val, edge.flow);
+    if (edge.rank_location == mpi_rank) {
+      if (set_sink_label(vertices[to_id].id, mpi_rank, to_id, edge.vert_index,
+                         label_val, entry.edge_index, tid)) {
+        return lookup_global_id(sink_id);
+      }
+    } else {
+      // send message to the owner of the "to" node
+      struct message_data msg = {
+          vertices[to_id].id, // sender's node
+          edge.dest_node_id,  // receiver's node
+          label_val,          // label value
+          pass,               // current pass
+          entry.edge_index,   // edge index
+          (global_id)-1,      // branch (unused)
+      };
+      queue_label_message(edge.rank_location, SET_SINK_LABEL, msg, tid);
+    }
+    return -1;
+  }
+
+  struct in_edge &rev_edge = vertices[to_id].in_edges[entry.edge_index];
+  // check if "from" node (which holds the flow) is on another rank
+  if (rev_edge.rank_location == mpi_rank) {
+    local_id from_id = rev_edge.vert_index;
+    const struct out_edge &edge =
+        vertices[from_id].out_edges[rev_edge.out_index];
+    int flow_diff = edge.capacity - edge.flow;
+    if (flow_diff < scaling_delta) {
+      return -1; // discard edge
+    }
+    if (set_sink_label(vertices[to_id].id, mpi_rank, to_id, from_id,
+                       min(sink_label_val, flow_diff), rev_edge.out_index,
+                       tid)) {
+      return lookup_global_id(sink_id);
+    }
+  } else {
+    // send message to the owner of the "from" node
+    struct message_data msg = {
+        vertices[to_id].id,    // sender's node
+        rev_edge.dest_node_id, // receiver's node
+        sink_label_val,        // label value
+        pass,                  // current pass
+        rev_edge.out_index,    // edge index
+        (global_id)-1,         // branch (unused)
+    };
+    queue_label_message(rev_edge.rank_location, COMPUTE_SINK_LABEL, msg, tid);
+  }
+  return -1;
+}
+
+/*********** Push-Relabel Engine ***************/
+
+/**
+ * A bulk-synchronous, distributed version of the Goldberg-Tarjan push-relabel
+ * algorithm.
  *
- * @param tag
- * @param sender Defaults to the previous rank.
+ * Each round, the threads on every rank discharge the active local nodes using
+ * the lock-free push and relabel operations from Hong and He in
+ * https://doi.org/10.1109/TPDS.2010.156, reading the heights of nodes on other
+ * ranks from the previous round. Flow pushed to another rank and new heights
+ * of border nodes are then exchanged all at once. Global relabels (a BFS from
+ * the sink, then from the source) and the gap heuristic are run between rounds.
  */
-void wait_and_flush(int tag,
-                    int sender = (mpi_rank - 1 + mpi_size) % mpi_size) {
-  struct message_data msg = {};
-  MPI_Status stat;
-  do {
-    MPI_Recv(&msg, 1, MPI_MESSAGE_TYPE, MPI_ANY_SOURCE, MPI_ANY_TAG,
-             MPI_COMM_WORLD, &stat);
-  } while (stat.MPI_TAG != tag || stat.MPI_SOURCE != sender);
+
+/// Number of global relabels per relabel of every node, on average
+#define PR_GLOBAL_RELABEL_FREQUENCY 1.0
+/**
+ * Most nodes the push-relabel and Dinic engines can handle. Heights are ints,
+ * and the highest, a node blocked by the Dinic engine while parked at twice
+ * the node count, is about four times the node count.
+ */
+#define PR_MAX_NODE_COUNT ((global_id)(INT_MAX - 1) / 4)
+/// Number of levels each rank searches past the global frontier in each round
+/// of pr_bfs()
+#define PR_BFS_ROUND_DEPTH 8
+
+/// Kinds of messages exchanged between rounds of the push-relabel engine
+enum pr_message_kind : int {
+  /// Flow was pushed along an edge into its "to" node, @a vertex. @a edge_index
+  /// is the edge's index in the @c in_edges list of @a vertex.
+  PR_PUSH_FORWARD,
+  /// Flow was pushed back along an edge into its "from" node, @a vertex.
+  /// @a edge_index is the edge's index in the @c out_edges list of @a vertex.
+  PR_PUSH_BACKWARD,
+  /// @a vertex, which is on the sending rank, now has height @a value
+  PR_HEIGHT,
+  /// Global relabel: @a vertex is at distance @a value, if the edge at
+  /// @a edge_index in its @c out_edges list has residual capacity
+  PR_BFS_CHECK,
+  /// Global relabel: @a vertex is at distance @a value
+  PR_BFS_SET,
+  /// Setup: the edge at @a edge_index in the @c out_edges list of @a vertex is
+  /// at index @a value in the @c in_edges list of its "to" node
+  PR_PARTNER,
+};
+
+struct pr_message {
+  /// The node this message is about. It is on the receiving rank, except for
+  /// PR_HEIGHT messages.
+  global_id vertex;
+  /// One of pr_message_kind
+  int kind;
+  int value;
+  unsigned int edge_index;
+};
+MPI_Datatype MPI_PR_MESSAGE_TYPE;
+
+/// Height of each local node
+vector<int> pr_height;
+/// Excess flow of each local node
+vector<int> pr_excess;
+/// Whether each local node is queued or being discharged
+vector<char> pr_queued;
+/// Number of local nodes that are queued or being discharged
+int pr_pending;
+/// Local indices of the source and sink, or (local_id)-1 if on another rank
+local_id pr_source_idx;
+local_id pr_sink_idx;
+
+/**
+ * For each in-edge from a node on another rank, this rank's copy of the
+ * edge's flow. It only changes through pushes, so it is exact between rounds.
+ */
+vector<int> pr_mirror_flow;
+/// For each out-edge, the edge's index in the @c in_edges list of its "to"
+/// node
+vector<unsigned int> pr_partner;
+/// For each out-edge and in-edge to a node on another rank, the index of that
+/// node in @c pr_ghost_height
+vector<size_t> pr_out_ghost;
+vector<size_t> pr_in_ghost;
+/// Heights of the nodes on other ranks that share an edge with this rank, as
+/// of the end of the last round
+vector<int> pr_ghost_height;
+unordered_map<global_id, size_t> pr_ghost_index;
+/// The other ranks holding a neighbor of local node @c i are
+/// <tt>pr_neighbor_ranks[pr_rank_offsets[i]:pr_rank_offsets[i + 1]]</tt>
+vector<size_t> pr_rank_offsets;
+vector<int> pr_neighbor_ranks;
+/**
+ * Number of local nodes at each height below @c pr_counted_heights, for the
+ * gap heuristic
+ */
+vector<int> pr_height_count;
+/**
+ * Number of heights counted in @c pr_height_count: the node count, or the size
+ * of the largest partition if that is smaller, and the same on every rank. So
+ * the counts take no more memory than the partition itself. Gaps above it
+ * are left to the global relabels.
+ */
+int pr_counted_heights;
+
+/// Per thread: messages to send at the end of the round, indexed by rank
+vector<vector<vector<struct pr_message>>> pr_outbox;
+/// Per thread: border nodes whose height changed this round
+vector<vector<local_id>> pr_changed;
+/// Whether each local node is in one of the @c pr_changed lists
+vector<char> pr_height_changed;
+/// Per thread: heights whose local count dropped to zero this round
+vector<vector<int>> pr_emptied;
+/// Number of relabels on this rank this round
+long pr_relabels;
+/// Set once this rank has done enough relabels for a global relabel to be
+/// worthwhile, which ends the round early
+bool pr_round_over;
+/// Total number of relabels on all ranks since the last global relabel
+long pr_relabels_since_global;
+/// Set by thread 0 once no rank has any active nodes left
+bool pr_done;
+
+/// The node count, which main() checks is at most PR_MAX_NODE_COUNT
+int pr_node_count() { return (int)graph_node_count; }
+
+/**
+ * Sets the height of local node @p v. Only called by the thread discharging
+ * @p v, or by thread 0 between rounds.
+ */
+void pr_set_height(local_id v, int height, int tid) {
+  int old_height = pr_height[v];
+  __atomic_store_n(&pr_height[v], height, __ATOMIC_RELAXED);
+  if (old_height < pr_counted_heights &&
+      __sync_sub_and_fetch(&pr_height_count[old_height], 1) == 0) {
+    pr_emptied[tid].push_back(old_height);
+  }
+  if (height < pr_counted_heights) {
+    __sync_fetch_and_add(&pr_height_count[height], 1);
+  }
+  // neighbors on other ranks need to hear about it
+  if (pr_rank_offsets[v] != pr_rank_offsets[v + 1] && !pr_height_changed[v]) {
+    pr_height_changed[v] = true;
+    pr_changed[tid].push_back(v);
+  }
 }
 
-void *run_algorithm(struct thread_params *params) {
-  int tid = params->tid;
-  Barrier &barrier = params->barrier;
+/**
+ * Queues local node @p v to be discharged, if it has excess flow and isn't
+ * queued already.
+ */
+void pr_activate(local_id v, int tid) {
+  if (v == pr_source_idx || v == pr_sink_idx) {
+    return;
+  }
+  if (__atomic_load_n(&pr_excess[v], __ATOMIC_SEQ_CST) > 0 &&
+      __sync_bool_compare_and_swap(&pr_queued[v], false, true)) {
+    __sync_fetch_and_add(&pr_pending, 1);
+    struct edge_entry entry = {v, true, false, 0};
+    edge_deques[tid].push(entry);
+  }
+}
 
-  while (!algorithm_complete) {
-    // synchronize all threads before each iteration
-    barrier.wait();
+/**
+ * Pushes @p delta units of flow from local node @p u along one of its edges.
+ *
+ * @param outgoing Whether the edge is in @c out_edges (increasing its flow) or
+ *                 in @c in_edges (decreasing the flow of the matching out-edge)
+ * @param edge_idx The index of the edge in its list
+ */
+void pr_push(local_id u, bool outgoing, unsigned int edge_idx, int delta,
+             int tid) {
+  const struct vertex vert = vertices[u];
+  __sync_fetch_and_sub(&pr_excess[u], delta);
+  if (outgoing) {
+    struct out_edge &edge = vert.out_edges[edge_idx];
+    __sync_fetch_and_add(&edge.flow, delta);
+    if (edge.rank_location == mpi_rank) {
+      __sync_fetch_and_add(&pr_excess[edge.vert_index], delta);
+      pr_activate(edge.vert_index, tid);
+    } else {
+      size_t pos = vertices.out_edge_offset(u) + edge_idx;
+      struct pr_message msg = {edge.dest_node_id, PR_PUSH_FORWARD, delta,
+                               pr_partner[pos]};
+      pr_outbox[tid][edge.rank_location].push_back(msg);
+    }
+  } else {
+    const struct in_edge &edge = vert.in_edges[edge_idx];
+    if (edge.rank_location == mpi_rank) {
+      __sync_fetch_and_sub(
+          &vertices[edge.vert_index].out_edges[edge.out_index].flow, delta);
+      __sync_fetch_and_add(&pr_excess[edge.vert_index], delta);
+      pr_activate(edge.vert_index, tid);
+    } else {
+      pr_mirror_flow[vertices.in_edge_offset(u) + edge_idx] -= delta;
+      struct pr_message msg = {edge.dest_node_id, PR_PUSH_BACKWARD, delta,
+                               edge.out_index};
+      pr_outbox[tid][edge.rank_location].push_back(msg);
+    }
+  }
+}
 
-    /*--------*
-     | Step 1 |
-     *--------*/
-    if (tid == 0) {
-      // wipe previous labels
-      fill(labels.begin(), labels.end(), EMPTY_LABEL);
-      // setup globals
-      working_threads = 0;
-      my_color = TOKEN_WHITE;
-      have_token = mpi_rank == 0;
-      token_color = TOKEN_WHITE;
-      queue_is_empty = false;
-      sink_found = false;
-      step_3_tid = -1;
+/**
+ * Pushes the excess flow of local node @p u to its lowest neighbors,
+ * relabelling it whenever none of them are lower than it.
+ */
+void pr_discharge(local_id u, int tid) {
+  const struct vertex vert = vertices[u];
+  size_t out_base = vertices.out_edge_offset(u);
+  size_t in_base = vertices.in_edge_offset(u);
+  int excess;
+  while ((excess = __atomic_load_n(&pr_excess[u], __ATOMIC_SEQ_CST)) > 0) {
+    // find the lowest neighbor we can push to
+    int min_height = numeric_limits<int>::max();
+    int min_residual = 0;
+    bool min_outgoing = true;
+    unsigned int min_idx = 0;
+    for (unsigned int i = 0; i < vert.out_edges.size(); ++i) {
+      const struct out_edge &edge = vert.out_edges[i];
+      int residual =
+          edge.capacity - __atomic_load_n(&edge.flow, __ATOMIC_RELAXED);
+      if (residual <= 0) {
+        continue;
+      }
+      int height =
+          edge.rank_location == mpi_rank
+              ? __atomic_load_n(&pr_height[edge.vert_index], __ATOMIC_RELAXED)
+              : pr_ghost_height[pr_out_ghost[out_base + i]];
+      if (height < min_height) {
+        min_height = height;
+        min_residual = residual;
+        min_outgoing = true;
+        min_idx = i;
+      }
+    }
+    for (unsigned int i = 0; i < vert.in_edges.size(); ++i) {
+      const struct in_edge &edge = vert.in_edges[i];
+      int residual;
+      int height;
+      if (edge.rank_location == mpi_rank) {
+        residual = __atomic_load_n(
+            &vertices[edge.vert_index].out_edges[edge.out_index].flow,
+            __ATOMIC_RELAXED);
+        height =
+            __atomic_load_n(&pr_height[edge.vert_index], __ATOMIC_RELAXED);
+      } else {
+        residual = pr_mirror_flow[in_base + i];
+        height = pr_ghost_height[pr_in_ghost[in_base + i]];
+      }
+      if (residual > 0 && height < min_height) {
+        min_height = height;
+        min_residual = residual;
+        min_outgoing = false;
+        min_idx = i;
+      }
+    }
 
-      // empty out edge queue
-      edge_entry entry = {};
-      while (edge_queue.pop(entry))
-        ;
-      DEBUG(1, "Pass %d:", pass);
-      // find source node
-      local_id i = lookup_global_id(source_id);
-      if (i != (local_id)-1) {
-        set_label(source_id, mpi_rank, i, i,
-                  numeric_limits<decltype(labels[i].value)>::max(), tid);
+    if (min_height == numeric_limits<int>::max()) {
+      ERROR("node %llu has excess %d, but no residual edges", vert.id, excess);
+      break;
+    }
+    if (pr_height[u] > min_height) {
+      pr_push(u, min_outgoing, min_idx, min(excess, min_residual), tid);
+    } else {
+      pr_set_height(u, min_height + 1, tid);
+      if (__sync_add_and_fetch(&pr_relabels, 1) >
+          PR_GLOBAL_RELABEL_FREQUENCY * vertices.size()) {
+        // heights are drifting away from the real distances, so stop here
+        // and leave the rest of the excess for after the global relabel
+        __atomic_store_n(&pr_round_over, true, __ATOMIC_SEQ_CST);
+        break;
       }
     }
+  }
+}
 
-    /**
-     * In step 3, holds the local index of the node that the backtracking
-     * algorithm is currently processing. Local to each thread.
-     *
-     * Set to @c (local_id)-1 if the current backtracking node is not on this
-     * rank.
-     */
-    local_id bt_idx = -1;
-    /// Label value of sink node
-    int sink_value = 0;
+/**
+ * Sends every thread's outbox to its destination rank, and stores the
+ * messages sent to this rank in @p inbox. Must be called by thread 0 on every
+ * rank at once, while the other threads are waiting.
+ */
+void pr_exchange(vector<struct pr_message> &inbox) {
+  vector<int> send_counts(mpi_size, 0);
+  vector<int> recv_counts(mpi_size, 0);
+  vector<struct pr_message> outgoing;
+  for (int dest = 0; dest < mpi_size; ++dest) {
+    for (size_t t = 0; t < pr_outbox.size(); ++t) {
+      vector<struct pr_message> &box = pr_outbox[t][dest];
+      outgoing.insert(outgoing.end(), box.begin(), box.end());
+      send_counts[dest] += box.size();
+      box.clear();
+    }
+  }
+  MPI_Alltoall(send_counts.data(), 1, MPI_INT, recv_counts.data(), 1, MPI_INT,
+               MPI_COMM_WORLD);
+  vector<int> send_displs(mpi_size, 0);
+  vector<int> recv_displs(mpi_size, 0);
+  for (int i = 1; i < mpi_size; ++i) {
+    send_displs[i] = send_displs[i - 1] + send_counts[i - 1];
+    recv_displs[i] = recv_displs[i - 1] + recv_counts[i - 1];
+  }
+  inbox.resize(recv_displs[mpi_size - 1] + recv_counts[mpi_size - 1]);
+  MPI_Alltoallv(outgoing.data(), send_counts.data(), send_displs.data(),
+                MPI_PR_MESSAGE_TYPE, inbox.data(), recv_counts.data(),
+                recv_displs.data(), MPI_PR_MESSAGE_TYPE, MPI_COMM_WORLD);
+}
 
-    // all threads must wait until everything is initialized
-    barrier.wait();
-    if (tid == 0) {
-      DEBUG(1, "------------------ START STEP 2 ------------------");
+/**
+ * Dinic engine: records that local node @p v received @p delta units of flow
+ * through one of its edges, if the node at the other end, with height
+ * @p sender_height, is on the level above @p v.
+ */
+void dn_record_inflow(local_id v, bool outgoing, unsigned int edge_idx,
+                      int sender_height, int delta);
+
+/// Applies received pushes, heights and setup messages.
+void pr_apply_messages(const vector<struct pr_message> &inbox, int tid) {
+  for (size_t i = 0; i < inbox.size(); ++i) {
+    const struct pr_message &msg = inbox[i];
+    if (msg.kind == PR_HEIGHT) {
+      pr_ghost_height[pr_ghost_index[msg.vertex]] = msg.value;
+      continue;
+    }
+    local_id v = lookup_global_id(msg.vertex);
+    if (v == (local_id)-1) {
+      ERROR("push-relabel message sent to wrong rank");
+      continue;
+    }
+    switch (msg.kind) {
+    case PR_PUSH_FORWARD:
+      pr_mirror_flow[vertices.in_edge_offset(v) + msg.edge_index] += msg.value;
+      if (engine == ENGINE_DINIC) {
+        size_t ghost = pr_in_ghost[vertices.in_edge_offset(v) + msg.edge_index];
+        dn_record_inflow(v, false, msg.edge_index, pr_ghost_height[ghost],
+                         msg.value);
+      }
+      pr_excess[v] += msg.value;
+      pr_activate(v, tid);
+      break;
+    case PR_PUSH_BACKWARD:
+      vertices[v].out_edges[msg.edge_index].flow -= msg.value;
+      if (engine == ENGINE_DINIC) {
+        size_t ghost =
+            pr_out_ghost[vertices.out_edge_offset(v) + msg.edge_index];
+        dn_record_inflow(v, true, msg.edge_index, pr_ghost_height[ghost],
+                         msg.value);
+      }
+      pr_excess[v] += msg.value;
+      pr_activate(v, tid);
+      break;
+    case PR_PARTNER:
+      pr_partner[vertices.out_edge_offset(v) + msg.edge_index] = msg.value;
+      break;
+    default:
+      ERROR("got invalid push-relabel message %d", msg.kind);
+      break;
     }
+  }
+}
 
-    /*--------*
-     | Step 2 |
-     *--------*/
-    // Thread 0 handles all incoming messages, while the other threads run the
-    // actual algorithm
-    if (tid == 0) {
-      struct message_data msg = {};
-      local_id vert_idx;
-      int curr_flow;
+/// Tells the neighbors on other ranks about the new height of local node @p v.
+void pr_send_height(local_id v, int tid) {
+  struct pr_message msg = {vertices[v].id, PR_HEIGHT, pr_height[v], 0};
+  for (size_t i = pr_rank_offsets[v]; i < pr_rank_offsets[v + 1]; ++i) {
+    pr_outbox[tid][pr_neighbor_ranks[i]].push_back(msg);
+  }
+}
 
-      while (!sink_found) {
-        // if message tag is SINK_FOUND, set do_step_3 and sink_found to true,
-        // so thread 0 on this rank will do step 3.
-        MPI_Status stat;
-        MPI_Recv(&msg, 1, MPI_MESSAGE_TYPE, MPI_ANY_SOURCE, MPI_ANY_TAG,
-                 MPI_COMM_WORLD, &stat);
-        __sync_fetch_and_add(&working_threads, 1);
-        DEBUG(2, "S2: got msg %s from R%d", tag2str(stat.MPI_TAG),
-              stat.MPI_SOURCE);
-        switch (stat.MPI_TAG) {
-        case SET_TO_LABEL:
-          // try to set label of "to" node
-          vert_idx = lookup_global_id(msg.receivers_node);
-          if (vert_idx == (local_id)-1) {
-            ERROR("SET_TO_LABEL sent to wrong rank");
-            __sync_fetch_and_sub(&working_threads, 1);
-            continue;
-          }
-          if (msg.pass != pass) {
-            ERROR("***** Got old message! *****");
-            __sync_fetch_and_sub(&working_threads, 1);
-            continue;
-          }
-          if (set_label(msg.senders_node, stat.MPI_SOURCE, -1, vert_idx,
-                        msg.value, tid)) {
-            // found sink!
-            bt_idx = vert_idx;
-            DEBUG(1, "Setting step_3_tid from SET_TO_LABEL...");
-            int old_val = __sync_val_compare_and_swap(&step_3_tid, -1, tid);
-            if (old_val != -1) {
-              ERROR("Thread %d set step_3_tid, but we have bt_idx!", old_val);
-            }
-            sink_found = true;
-          }
-          break;
-        case COMPUTE_FROM_LABEL:
-          // compute and set label of "from" node
-          DEBUG(2, "looking up local id");
-          vert_idx = lookup_global_id(msg.receivers_node); // from_id
-          if (vert_idx == (local_id)-1) {
-            ERROR("COMPUTE_FROM_LABEL sent to wrong rank");
-            __sync_fetch_and_sub(&working_threads, 1);
-            continue;
-          }
-          if (msg.pass != pass) {
-            ERROR("***** Got old message! *****");
-            __sync_fetch_and_sub(&working_threads, 1);
-            continue;
-          }
+/// A local node whose BFS distance was lowered to @c first, to be expanded
+typedef pair<int, local_id> pr_bfs_entry;
 
-          // TODO: check this, bug found here in handle_in_edge
-          // find edge for the sender's node, and get the flow through it
-          curr_flow = 0;
-          DEBUG(2, "size of out_edges: %lu",
-                vertices[vert_idx].out_edges.size());
-          for (auto it = vertices[vert_idx].out_edges.begin();
-               it != vertices[vert_idx].out_edges.end(); ++it) {
-            if (it->dest_node_id == msg.senders_node) {
-              curr_flow = it->flow;
-              break;
-            }
-          }
-          if (curr_flow <= 0) {
-            __sync_fetch_and_sub(&working_threads, 1);
-            continue; // discard edge
-          }
+/**
+ * Lowers the BFS distance of local node @p v to @p dist, if it has none or a
+ * longer one, and adds it to @p reached if so.
+ *
+ * @param skip_source Whether the source should be left without a distance
+ */
+void pr_lower_dist(local_id v, int dist, vector<int> &dists,
+                   vector<pr_bfs_entry> &reached, bool skip_source) {
+  if ((dists[v] == -1 || dist < dists[v]) &&
+      !(skip_source && v == pr_source_idx)) {
+    dists[v] = dist;
+    reached.push_back(pr_bfs_entry(dist, v));
+  }
+}
 
-          // set label and add edges
-          if (set_label(msg.senders_node, stat.MPI_SOURCE, -1, vert_idx,
-                        -min(abs(msg.value), curr_flow), tid)) {
-            // found sink!
-            ERROR("outgoing edge from sink!");
-            bt_idx = vert_idx;
-            DEBUG(1, "Setting step_3_tid from COMPUTE_FROM_LABEL...");
-            int old_val = __sync_val_compare_and_swap(&step_3_tid, -1, tid);
-            if (old_val != -1) {
-              ERROR("Thread %d set step_3_tid, but we have bt_idx!", old_val);
-            }
-            sink_found = true;
-          }
-          break;
-        case SINK_FOUND:
-          if (mpi_size > 1) {
-            DEBUG(1, "Setting step_3_tid from SINK_FOUND...");
-            int old_val = __sync_val_compare_and_swap(&step_3_tid, -1, tid);
-            if (old_val == -1) {
-              DEBUG(1, "We will handle step 3");
-            } else {
-              DEBUG(1, "Thread %d is handling step 3", old_val);
-            }
-            sink_found = true;
-          } else {
-            // running with one rank
-            sink_found = true;
-            // flush white tokens from own rank
-            int flag = 1;
-            do {
-              MPI_Iprobe(mpi_rank, TOKEN_WHITE, MPI_COMM_WORLD, &flag,
-                         MPI_STATUS_IGNORE);
-              if (flag) {
-                MPI_Recv(NULL, 0, MPI_MESSAGE_TYPE, mpi_rank, TOKEN_WHITE,
-                         MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-              }
-            } while (flag);
-          }
-          break;
-        case TOKEN_WHITE:
-        case TOKEN_RED:
-          token_color = (enum message_tags)stat.MPI_TAG;
-          if (mpi_rank == 0) {
-            if (token_color == TOKEN_WHITE) {
-              // check termination: send message to all ranks then Allreduce
-              DEBUG(1, "S2: got white token, sending CHECK_TERMINATION to all "
-                       "ranks");
-              for (int i = 1; i < mpi_size; ++i) {
-                MPI_Ssend(NULL, 0, MPI_MESSAGE_TYPE, i, CHECK_TERMINATION,
-                          MPI_COMM_WORLD);
-              }
-              // if result is 0, then all queues are empty, and we are done.
-              int empty = queue_is_empty ? 0 : 1;
-              int result = 0;
-              MPI_Allreduce(&empty, &result, 1, MPI_INT, MPI_SUM,
-                            MPI_COMM_WORLD);
-              if (result == 0) {
-                DEBUG(1, "Algorithm complete!");
-                __sync_fetch_and_sub(&working_threads, 1);
-                delete params;
-                algorithm_complete = true;
-                return NULL;
-              } else {
-                DEBUG(1, "Not all ranks have empty queues, continuing");
-              }
-            } else {
-              // reset token color
-              token_color = TOKEN_WHITE;
-            }
-          }
-          DEBUG(1, "S2: we now have the token");
-          have_token = true;
-          break;
-        case CHECK_TERMINATION: {
-          // if result is 0, then all queues are empty, and we are done.
-          int empty = queue_is_empty ? 0 : 1; // sum should be 0
-          int result = 0;
-          MPI_Allreduce(&empty, &result, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
-          if (result == 0) {
-            DEBUG(1, "Algorithm complete!");
-            __sync_fetch_and_sub(&working_threads, 1);
-            delete params;
-            algorithm_complete = true;
-            return NULL;
-          }
-        } break;
-        default:
-          ERROR("got invalid tag in step 2: %s", tag2str(stat.MPI_TAG));
-          break;
-        }
-        __sync_fetch_and_sub(&working_threads, 1);
-      }
+/**
+ * Runs the BFS of pr_bfs() over the local nodes in @p pending, each at its own
+ * distance, and the nodes reached from them, expanding those closer than
+ * @p limit. The nodes are expanded in order of distance, merging the sorted
+ * pending nodes with the ones reached from them. Edges to nodes on other ranks
+ * are left in this thread's outbox, and the nodes at or past @p limit in
+ * @p pending.
+ */
+void pr_relax_dists(vector<pr_bfs_entry> &pending, int limit,
+                    vector<int> &dists, bool skip_source, int tid) {
+  sort(pending.begin(), pending.end());
+  vector<pr_bfs_entry> reached;
+  size_t p = 0;
+  size_t r = 0;
+  while (p < pending.size() || r < reached.size()) {
+    pr_bfs_entry entry;
+    if (r < reached.size() &&
+        (p == pending.size() || reached[r] < pending[p])) {
+      entry = reached[r++];
     } else {
-      struct edge_entry entry = {0, false, 0};
-      while (!sink_found) {
-        {
-          ScopedLock l(h_lock);
-          // wait for the queue to become non-empty
-          while (!edge_queue.pop(entry) && !sink_found && !algorithm_complete) {
-            // TODO: may need a mutex. Acquire before entering while loop.
-            queue_is_empty = true;
-            if (have_token && working_threads == 0 && !sink_found) {
-              // send token
-              // note: our color can only be changed after sending the token
-              // (done here) or by a running thread. If we are here, then we
-              // must be the only running thread.
-              if (my_color == TOKEN_RED) {
-                token_color = TOKEN_RED;
-              }
-              // send token to next rank
-              have_token = false;
-              DEBUG(1, "S2: queue empty, sending %s token to R%d",
-                    token_color == TOKEN_WHITE ? "white" : "red",
-                    (mpi_rank + 1) % mpi_size);
-              MPI_Ssend(NULL, 0, MPI_MESSAGE_TYPE, (mpi_rank + 1) % mpi_size,
-                        token_color, MPI_COMM_WORLD);
-              my_color = TOKEN_WHITE;
-            }
-          }
-          if (algorithm_complete) {
-            DEBUG(1, "Algorithm complete!");
-            delete params;
-            return NULL;
-          }
-
-          __sync_fetch_and_add(&working_threads, 1);
-          queue_is_empty = false;
-          // release the lock on edge_queue now, so other threads can get edges
-        }
-
-        if (sink_found) {
-          __sync_fetch_and_sub(&working_threads, 1);
-          break;
+      entry = pending[p++];
+    }
+    if (entry.first != dists[entry.second]) {
+      continue; // lowered again since it was queued
+    }
+    if (entry.first >= limit) {
+      // so are all the others, which wait for the next round
+      vector<pr_bfs_entry> left;
+      left.push_back(entry);
+      left.insert(left.end(), pending.begin() + p, pending.end());
+      left.insert(left.end(), reached.begin() + r, reached.end());
+      pending.swap(left);
+      return;
+    }
+    int dist = entry.first + 1;
+    const struct vertex w = vertices[entry.second];
+    // backward residual edges into w
+    for (unsigned int i = 0; i < w.out_edges.size(); ++i) {
+      const struct out_edge &edge = w.out_edges[i];
+      if (edge.flow <= 0) {
+        continue;
+      }
+      if (edge.rank_location == mpi_rank) {
+        pr_lower_dist(edge.vert_index, dist, dists, reached, skip_source);
+      } else {
+        struct pr_message msg = {edge.dest_node_id, PR_BFS_SET, dist, 0};
+        pr_outbox[tid][edge.rank_location].push_back(msg);
+      }
+    }
+    // forward residual edges into w
+    for (unsigned int i = 0; i < w.in_edges.size(); ++i) {
+      const struct in_edge &edge = w.in_edges[i];
+      if (edge.rank_location == mpi_rank) {
+        const struct out_edge &out =
+            vertices[edge.vert_index].out_edges[edge.out_index];
+        if (out.capacity - out.flow > 0) {
+          pr_lower_dist(edge.vert_index, dist, dists, reached, skip_source);
         }
+      } else {
+        struct pr_message msg = {edge.dest_node_id, PR_BFS_CHECK, dist,
+                                 edge.out_index};
+        pr_outbox[tid][edge.rank_location].push_back(msg);
+      }
+    }
+  }
+  pending.clear();
+}
 
-        // process edge
-        if (entry.is_outgoing) {
-          bt_idx = handle_out_edge(entry, tid);
-        } else {
-          bt_idx = handle_in_edge(entry, tid);
-        }
-        if (bt_idx != (local_id)-1) {
-          DEBUG(1, "Found sink node!");
-          DEBUG(1, "Setting step_3_tid from worker thread...");
-          int old_val = __sync_val_compare_and_swap(&step_3_tid, -1, tid);
-          if (old_val != -1) {
-            ERROR("Thread %d set step_3_tid, but we have bt_idx!", old_val);
-          }
-          // tell thread 0 that the sink was found, to make sure it stops
-          // before we start step 3. It will also set sink_found, so the other
-          // worker threads stop too.
-          DEBUG(1, "S2: sending msg SINK_FOUND to R%d (self)", mpi_rank);
-          MPI_Ssend(NULL, 0, MPI_MESSAGE_TYPE, mpi_rank, SINK_FOUND,
-                    MPI_COMM_WORLD);
-          sink_found = true;
-          __sync_fetch_and_sub(&working_threads, 1);
-          break;
+/**
+ * Distributed BFS backwards through the residual graph from @p root_id, which
+ * sets @c dists to the distance from each node to the root plus @p offset.
+ * Nodes that already have a shorter distance are skipped.
+ *
+ * Each round, every rank runs the BFS over its own nodes up to
+ * PR_BFS_ROUND_DEPTH levels past the closest node waiting on any rank, before
+ * the edges to other ranks are exchanged. Those may lower distances that were
+ * found through a longer local path, and the BFS carries on from them. So a
+ * round covers many levels, but a node is rarely expanded more than once.
+ * The BFS ends once no rank has any nodes waiting.
+ *
+ * @param skip_source Whether to stop at the source instead of giving it a
+ *                    distance, like push-relabel needs
+ */
+void pr_bfs(global_id root_id, int offset, vector<int> &dists, int tid,
+            bool skip_source = true) {
+  vector<pr_bfs_entry> pending;
+  vector<struct pr_message> inbox;
+  local_id root = lookup_global_id(root_id);
+  if (root != (local_id)-1 && dists[root] == -1) {
+    dists[root] = offset;
+    pending.push_back(pr_bfs_entry(offset, root));
+  }
+  int rounds = 0;
+  while (true) {
+    int local_min = numeric_limits<int>::max();
+    for (size_t i = 0; i < pending.size(); ++i) {
+      if (pending[i].first == dists[pending[i].second]) {
+        local_min = min(local_min, pending[i].first);
+      }
+    }
+    int global_min = 0;
+    MPI_Allreduce(&local_min, &global_min, 1, MPI_INT, MPI_MIN,
+                  MPI_COMM_WORLD);
+    if (global_min == numeric_limits<int>::max()) {
+      break;
+    }
+    pr_relax_dists(pending, global_min + PR_BFS_ROUND_DEPTH, dists,
+                   skip_source, tid);
+    pr_exchange(inbox);
+    ++rounds;
+    for (size_t i = 0; i < inbox.size(); ++i) {
+      local_id v = lookup_global_id(inbox[i].vertex);
+      if (inbox[i].kind == PR_BFS_CHECK) {
+        const struct out_edge &out = vertices[v].out_edges[inbox[i].edge_index];
+        if (out.capacity - out.flow <= 0) {
+          continue;
         }
-        __sync_fetch_and_sub(&working_threads, 1);
       }
+      pr_lower_dist(v, inbox[i].value, dists, pending, skip_source);
     }
+  }
+  DEBUG(1, "PR: BFS from %llu took %d rounds", root_id, rounds);
+}
 
-    // make sure all threads finish step 2
-    barrier.wait();
-
-    /*--------*
-     | Step 3 |
-     *--------*/
-    // go to the beginning of the loop and wait if not handling step 3.
-    if (__sync_fetch_and_add(&step_3_tid, 0) != tid) {
-      DEBUG(1, "returning to wait for step 3 to finish");
-      continue;
+/**
+ * Sets every height to the exact residual distance to the sink, or to the node
+ * count plus the distance to the source if the sink can't be reached. Called
+ * by thread 0 on every rank at once, between rounds.
+ */
+void pr_global_relabel(int tid) {
+  int n = pr_node_count();
+  vector<int> dists(vertices.size(), -1);
+  pr_bfs(sink_id, 0, dists, tid);
+  pr_bfs(source_id, n, dists, tid);
+
+  fill(pr_height_count.begin(), pr_height_count.end(), 0);
+  for (local_id v = 0; v < vertices.size(); ++v) {
+    // nodes that reach neither can't have excess, so park them out of the way
+    pr_height[v] = dists[v] == -1 ? 2 * n : dists[v];
+    if (pr_height[v] < pr_counted_heights) {
+      ++pr_height_count[pr_height[v]];
     }
+  }
+  for (size_t t = 0; t < pr_changed.size(); ++t) {
+    pr_changed[t].clear();
+    pr_emptied[t].clear();
+  }
+  fill(pr_height_changed.begin(), pr_height_changed.end(), false);
 
-    DEBUG(1, "");
-    DEBUG(1, "After step 2:");
-    // dump_labels();
+  // every height may have changed
+  for (local_id v = 0; v < vertices.size(); ++v) {
+    pr_send_height(v, tid);
+  }
+  vector<struct pr_message> inbox;
+  pr_exchange(inbox);
+  pr_apply_messages(inbox, tid);
+  pr_relabels_since_global = 0;
+  DEBUG(1, "PR: global relabel done");
+}
 
-    int sink_founds_needed = 1;
-    if (bt_idx != (local_id)-1) {
-      // we found the sink and started step 3, so we need to get two SINK_FOUNDS
-      DEBUG(1, "Setting sink_founds_needed to 2, since we found the sink");
-      sink_founds_needed = 2;
-      sink_value = labels[bt_idx].value;
+/**
+ * Gap heuristic: if no node on any rank has height @c k, no node above @c k
+ * can reach the sink, so they are all lifted to the node count.
+ *
+ * Only the counted heights whose count dropped to zero on some rank this round
+ * are checked, so this costs much less than reducing the whole histogram.
+ */
+void pr_gap_relabel(int tid) {
+  int n = pr_node_count();
+  vector<int> candidates;
+  for (size_t t = 0; t < pr_emptied.size(); ++t) {
+    candidates.insert(candidates.end(), pr_emptied[t].begin(),
+                      pr_emptied[t].end());
+    pr_emptied[t].clear();
+  }
+  sort(candidates.begin(), candidates.end());
+  candidates.erase(unique(candidates.begin(), candidates.end()),
+                   candidates.end());
+
+  // collect every rank's candidates
+  int local_count = candidates.size();
+  vector<int> counts(mpi_size);
+  MPI_Allgather(&local_count, 1, MPI_INT, counts.data(), 1, MPI_INT,
+                MPI_COMM_WORLD);
+  vector<int> displs(mpi_size, 0);
+  for (int i = 1; i < mpi_size; ++i) {
+    displs[i] = displs[i - 1] + counts[i - 1];
+  }
+  vector<int> heights(displs[mpi_size - 1] + counts[mpi_size - 1]);
+  if (heights.empty()) {
+    return;
+  }
+  MPI_Allgatherv(candidates.data(), local_count, MPI_INT, heights.data(),
+                 counts.data(), displs.data(), MPI_INT, MPI_COMM_WORLD);
+  sort(heights.begin(), heights.end());
+  heights.erase(unique(heights.begin(), heights.end()), heights.end());
+
+  vector<int> local_totals(heights.size());
+  vector<int> totals(heights.size());
+  for (size_t i = 0; i < heights.size(); ++i) {
+    local_totals[i] = pr_height_count[heights[i]];
+  }
+  MPI_Allreduce(local_totals.data(), totals.data(), heights.size(), MPI_INT,
+                MPI_SUM, MPI_COMM_WORLD);
+  size_t i = 0;
+  while (i < heights.size() && totals[i] != 0) {
+    ++i;
+  }
+  if (i == heights.size()) {
+    return;
+  }
+  int gap = heights[i];
+  DEBUG(1, "PR: gap at height %d", gap);
+  for (local_id v = 0; v < vertices.size(); ++v) {
+    if (pr_height[v] > gap && pr_height[v] < n) {
+      pr_set_height(v, n, tid);
     }
-    if (mpi_size > 1) {
-      while (sink_founds_needed) {
-        DEBUG(1, "S3: sending SINK_FOUND to R%d", (mpi_rank + 1) % mpi_size);
-        MPI_Ssend(NULL, 0, MPI_MESSAGE_TYPE, (mpi_rank + 1) % mpi_size,
-                  SINK_FOUND, MPI_COMM_WORLD);
-        DEBUG(1, "S3: waiting for SINK_FOUND to be returned");
-        wait_and_flush(SINK_FOUND);
-        DEBUG(1, "S3: got SINK_FOUND from R%d",
-              (mpi_rank - 1 + mpi_size) % mpi_size);
-        --sink_founds_needed;
+  }
+  // lifting can only empty heights above the gap, which are already empty
+  for (size_t t = 0; t < pr_emptied.size(); ++t) {
+    pr_emptied[t].clear();
+  }
+}
+
+/**
+ * Sets up the state shared by the push-relabel and Dinic engines. Called by
+ * every rank before the threads start.
+ */
+void pr_setup() {
+  int tid = 0;
+  size_t out_total = vertices.all_out_edges().size();
+  size_t in_total = vertices.all_in_edges().size();
+  pr_height.assign(vertices.size(), 0);
+  pr_excess.assign(vertices.size(), 0);
+  pr_queued.assign(vertices.size(), false);
+  pr_height_changed.assign(vertices.size(), false);
+  long local_nodes = vertices.size();
+  long max_nodes = 0;
+  MPI_Allreduce(&local_nodes, &max_nodes, 1, MPI_LONG, MPI_MAX,
+                MPI_COMM_WORLD);
+  pr_counted_heights = min((long)pr_node_count(), max_nodes);
+  pr_height_count.assign(pr_counted_heights, 0);
+  pr_height_count[0] = vertices.size();
+  pr_mirror_flow.assign(in_total, 0);
+  pr_partner.assign(out_total, -1);
+  pr_out_ghost.assign(out_total, -1);
+  pr_in_ghost.assign(in_total, -1);
+  pr_outbox.assign(num_threads,
+                   vector<vector<struct pr_message>>(mpi_size));
+  pr_changed.assign(num_threads, vector<local_id>());
+  pr_emptied.assign(num_threads, vector<int>());
+  pr_relabels = 0;
+  pr_round_over = false;
+  pr_pending = 0;
+  pr_done = false;
+  pr_source_idx = lookup_global_id(source_id);
+  pr_sink_idx = lookup_global_id(sink_id);
+
+  // find the neighbors on other ranks, and tell their ranks where the edges
+  // between them are
+  vector<int> ranks;
+  pr_rank_offsets.assign(1, 0);
+  pr_neighbor_ranks.clear();
+  for (local_id v = 0; v < vertices.size(); ++v) {
+    const struct vertex vert = vertices[v];
+    size_t out_base = vertices.out_edge_offset(v);
+    size_t in_base = vertices.in_edge_offset(v);
+    ranks.clear();
+    for (unsigned int i = 0; i < vert.out_edges.size(); ++i) {
+      const struct out_edge &edge = vert.out_edges[i];
+      if (edge.rank_location != mpi_rank) {
+        auto it = pr_ghost_index.insert(
+            make_pair(edge.dest_node_id, pr_ghost_index.size()));
+        pr_out_ghost[out_base + i] = it.first->second;
+        ranks.push_back(edge.rank_location);
       }
-      // everyone but the finder has to pass the last message on
-      if (bt_idx == (local_id)-1) {
-        DEBUG(1, "S3: sending SINK_FOUND to R%d", (mpi_rank + 1) % mpi_size);
-        MPI_Ssend(NULL, 0, MPI_MESSAGE_TYPE, (mpi_rank + 1) % mpi_size,
-                  SINK_FOUND, MPI_COMM_WORLD);
+    }
+    for (unsigned int i = 0; i < vert.in_edges.size(); ++i) {
+      const struct in_edge &edge = vert.in_edges[i];
+      if (edge.rank_location != mpi_rank) {
+        auto it = pr_ghost_index.insert(
+            make_pair(edge.dest_node_id, pr_ghost_index.size()));
+        pr_in_ghost[in_base + i] = it.first->second;
+        ranks.push_back(edge.rank_location);
+        struct pr_message msg = {edge.dest_node_id, PR_PARTNER, (int)i,
+                                 edge.out_index};
+        pr_outbox[tid][edge.rank_location].push_back(msg);
+      } else {
+        pr_partner[vertices.out_edge_offset(edge.vert_index) +
+                   edge.out_index] = i;
       }
     }
+    sort(ranks.begin(), ranks.end());
+    ranks.erase(unique(ranks.begin(), ranks.end()), ranks.end());
+    pr_neighbor_ranks.insert(pr_neighbor_ranks.end(), ranks.begin(),
+                             ranks.end());
+    pr_rank_offsets.push_back(pr_neighbor_ranks.size());
+  }
+  pr_ghost_height.assign(pr_ghost_index.size(), 0);
+  vector<struct pr_message> inbox;
+  pr_exchange(inbox);
+  pr_apply_messages(inbox, tid);
+}
 
-    // flush rest of messages
-    int flag = 1;
-    do {
-      MPI_Status stat;
-      MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &flag, &stat);
-      if (flag) {
-        struct message_data msg = {};
-        MPI_Recv(&msg, 1, MPI_MESSAGE_TYPE, stat.MPI_SOURCE, stat.MPI_TAG,
-                 MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+/**
+ * Saturates the source's out-edges, and does the first global relabel.
+ * Called by every rank after pr_setup().
+ */
+void pr_start_preflow() {
+  int tid = 0;
+  vector<struct pr_message> inbox;
+  // saturate every edge out of the source
+  if (pr_source_idx != (local_id)-1) {
+    pr_set_height(pr_source_idx, pr_node_count(), tid);
+    const struct vertex src = vertices[pr_source_idx];
+    for (unsigned int i = 0; i < src.out_edges.size(); ++i) {
+      int delta = src.out_edges[i].capacity - src.out_edges[i].flow;
+      if (delta > 0) {
+        pr_excess[pr_source_idx] += delta;
+        pr_push(pr_source_idx, true, i, delta, tid);
       }
-    } while (flag);
+    }
+  }
+  pr_exchange(inbox);
+  pr_apply_messages(inbox, tid);
+  pr_global_relabel(tid);
+}
 
-    DEBUG(1, "entering barrier before step 3");
-    MPI_Barrier(MPI_COMM_WORLD);
-    DEBUG(1, "================== START STEP 3 ==================");
-    DEBUG(1, "My bt_idx is %ld", (ssize_t)bt_idx);
+/**
+ * Exchanges pushes and heights at the end of a round, and checks whether the
+ * algorithm is done. Called by thread 0 on every rank at once.
+ */
+void pr_finish_round(int tid) {
+  for (size_t t = 0; t < pr_changed.size(); ++t) {
+    for (size_t i = 0; i < pr_changed[t].size(); ++i) {
+      local_id v = pr_changed[t][i];
+      pr_height_changed[v] = false;
+      pr_send_height(v, tid);
+    }
+    pr_changed[t].clear();
+  }
+  vector<struct pr_message> inbox;
+  pr_exchange(inbox);
+  pr_apply_messages(inbox, tid);
+  pr_gap_relabel(tid);
+
+  long local[2] = {pr_pending, pr_relabels};
+  long total[2] = {0, 0};
+  pr_relabels = 0;
+  pr_round_over = false;
+  MPI_Allreduce(local, total, 2, MPI_LONG, MPI_SUM, MPI_COMM_WORLD);
+  DEBUG(2, "PR: %ld active nodes, %ld relabels", total[0], total[1]);
+  if (total[0] == 0) {
+    pr_done = true;
+    return;
+  }
+  pr_relabels_since_global += total[1];
+  if (pr_relabels_since_global >
+      PR_GLOBAL_RELABEL_FREQUENCY * pr_node_count()) {
+    pr_global_relabel(tid);
+  }
+}
 
-    // start backtracking
-    bool wait_for_source_found = false;
-    bool step_3_done = false;
-    while (!step_3_done) {
-      if (bt_idx != (local_id)-1) {
-        // update flow in local nodes
-        struct label &l = labels[bt_idx];
-        DEBUG(1, "S3: processing node %llu", vertices[bt_idx].id);
-        // TODO: looping over all edges will be slow for dense graphs
-        if (l.value > 0 && l.prev_rank_loc == mpi_rank) {
-          // bt_idx is a "from" node and previous node is local
-          // let f(y, x) += sink_value
-          for (auto it = vertices[l.prev_vert_index].out_edges.begin();
-               it != vertices[l.prev_vert_index].out_edges.end(); ++it) {
-            if (it->dest_node_id == vertices[bt_idx].id)
-              it->flow += sink_value;
-          }
-        } else if (l.value < 0) {
-          // let f(x, y) -= sink_value
-          for (auto it = vertices[bt_idx].out_edges.begin();
-               it != vertices[bt_idx].out_edges.end(); ++it) {
-            if (it->dest_node_id == l.prev_node)
-              it->flow -= sink_value;
-          }
-        }
+/*********** Dinic Engine ***************/
 
-        // if the previous node is not on this rank, send the next rank an
-        // UPDATE_FLOW message, then wait for incoming messages
-        if (l.prev_rank_loc != mpi_rank) {
-          // previous node is remote, send an UPDATE_FLOW message
-          struct message_data msg = {
-              vertices[bt_idx].id, // sender's node
-              l.prev_node,         // receiver's node
-              sink_value,          // label value
-              pass,                // current pass
-          };
-          DEBUG(1, "S3: sending UPDATE_FLOW to R%d", l.prev_rank_loc);
-          MPI_Ssend(&msg, 1, MPI_MESSAGE_TYPE, l.prev_rank_loc, UPDATE_FLOW,
-                    MPI_COMM_WORLD);
-          bt_idx = -1;
-        } else {
-          // check for source node
-          if (bt_idx == l.prev_vert_index && l.prev_node == source_id) {
-            // source node was already processed, exit the loop
-            wait_for_source_found = mpi_size > 1;
-            step_3_done = true;
-            continue;
-          }
-          // otherwise, keep following back-pointers
-          bt_idx = l.prev_vert_index;
-        }
-      } else {
-        // wait for incoming messages
-        struct message_data msg = {};
-        MPI_Status stat;
-        MPI_Recv(&msg, 1, MPI_MESSAGE_TYPE, MPI_ANY_SOURCE, MPI_ANY_TAG,
-                 MPI_COMM_WORLD, &stat);
-        DEBUG(1, "S3: got msg %s from R%d", tag2str(stat.MPI_TAG),
-              stat.MPI_SOURCE);
-        switch (stat.MPI_TAG) {
-        case SOURCE_FOUND:
-          // if SOURCE_FOUND is received, break and forward it the next rank
-          wait_for_source_found = false;
-          step_3_done = true;
-          break;
-        case UPDATE_FLOW: {
-          // find our local node
-          sink_value = msg.value;
-          local_id vert_idx = lookup_global_id(msg.receivers_node);
-          auto it = vertices[vert_idx].out_edges.begin();
-          // find the remote node in the local node's edge list
-          for (; it != vertices[vert_idx].out_edges.end(); ++it) {
-            if (it->dest_node_id == msg.senders_node)
-              it->flow += sink_value;
-          }
-          // if the sender's node is not found in out_edges, then vert_idx
-          // must be the "to" node and we don't need to do anything
-          bt_idx = vert_idx; // continue with the previous node
-        } break;
-        case SET_TO_LABEL:
-        case COMPUTE_FROM_LABEL:
-        case TOKEN_WHITE:
-        case TOKEN_RED:
-          DEBUG(1, "got old message during step 3 with tag %s",
-                tag2str(stat.MPI_TAG));
-          break;
-        default:
-          ERROR("got invalid message during step 3 with tag %s",
-                tag2str(stat.MPI_TAG));
-          break;
-        }
-      }
-    }
+/**
+ * A distributed version of Dinic's algorithm, built on the push-relabel state.
+ *
+ * Each phase starts with one distributed BFS from the sink, which puts every
+ * node on a level. Instead of finding augmenting paths through the level graph
+ * one at a time with a DFS, the blocking flow is found in parallel like in
+ * Karzanov's algorithm: the source floods its admissible edges, and each node
+ * pushes its excess down to the next level. A node that can't push any more is
+ * blocked for the rest of the phase, and returns its excess to the nodes that
+ * sent it. Pushes between ranks are exchanged in rounds, like in the
+ * push-relabel engine, so the ranks only synchronize a few times per phase
+ * instead of once per augmenting path.
+ */
 
-    // send SOURCE_FOUND message to next rank
-    if (mpi_size > 1) {
-      DEBUG(1, "S3: sending SOURCE_FOUND to R%d", (mpi_rank + 1) % mpi_size);
-      MPI_Ssend(NULL, 0, MPI_MESSAGE_TYPE, (mpi_rank + 1) % mpi_size,
-                SOURCE_FOUND, MPI_COMM_WORLD);
+/// For each out-edge and in-edge, the flow its node received through it from
+/// the level above during the current phase
+vector<int> dn_inflow_out;
+vector<int> dn_inflow_in;
+/// Number of phases run so far
+int dn_phases;
+
+/// Heights at or above this mean a node is blocked; the rest is its level.
+int dn_blocked_height() { return 2 * pr_node_count() + 1; }
+
+/// Returns the level of a node with height @p height.
+int dn_level(int height) {
+  return height >= dn_blocked_height() ? height - dn_blocked_height() : height;
+}
+
+void dn_record_inflow(local_id v, bool outgoing, unsigned int edge_idx,
+                      int sender_height, int delta) {
+  if (dn_level(sender_height) != dn_level(pr_height[v]) + 1) {
+    return; // flow being returned by a blocked node
+  }
+  if (outgoing) {
+    __sync_fetch_and_add(&dn_inflow_out[vertices.out_edge_offset(v) + edge_idx],
+                         delta);
+  } else {
+    __sync_fetch_and_add(&dn_inflow_in[vertices.in_edge_offset(v) + edge_idx],
+                         delta);
+  }
+}
+
+/**
+ * Finds an admissible edge of local node @p u, i.e. a residual edge to an
+ * unblocked node on the next level down.
+ *
+ * @return The residual capacity of the edge, or 0 if there isn't one
+ */
+int dn_find_admissible(local_id u, bool &outgoing, unsigned int &edge_idx) {
+  const struct vertex vert = vertices[u];
+  size_t out_base = vertices.out_edge_offset(u);
+  size_t in_base = vertices.in_edge_offset(u);
+  int target = pr_height[u] - 1;
+  for (unsigned int i = 0; i < vert.out_edges.size(); ++i) {
+    const struct out_edge &edge = vert.out_edges[i];
+    int residual =
+        edge.capacity - __atomic_load_n(&edge.flow, __ATOMIC_RELAXED);
+    if (residual <= 0) {
+      continue;
+    }
+    int height =
+        edge.rank_location == mpi_rank
+            ? __atomic_load_n(&pr_height[edge.vert_index], __ATOMIC_RELAXED)
+            : pr_ghost_height[pr_out_ghost[out_base + i]];
+    if (height == target) {
+      outgoing = true;
+      edge_idx = i;
+      return residual;
+    }
+  }
+  for (unsigned int i = 0; i < vert.in_edges.size(); ++i) {
+    const struct in_edge &edge = vert.in_edges[i];
+    int residual;
+    int height;
+    if (edge.rank_location == mpi_rank) {
+      residual = __atomic_load_n(
+          &vertices[edge.vert_index].out_edges[edge.out_index].flow,
+          __ATOMIC_RELAXED);
+      height = __atomic_load_n(&pr_height[edge.vert_index], __ATOMIC_RELAXED);
+    } else {
+      residual = pr_mirror_flow[in_base + i];
+      height = pr_ghost_height[pr_in_ghost[in_base + i]];
     }
-
-    // wait to receive the SOURCE_FOUND message from previous rank if
-    // necessary
-    if (wait_for_source_found) {
-      wait_and_flush(SOURCE_FOUND);
-      DEBUG(1, "S3: got SOURCE_FOUND from R%d, done with step 3",
-            (mpi_rank - 1 + mpi_size) % mpi_size);
+    if (residual > 0 && height == target) {
+      outgoing = false;
+      edge_idx = i;
+      return residual;
     }
-
-    DEBUG(1, "Entering barrier after step 3");
-    MPI_Barrier(MPI_COMM_WORLD);
-    DEBUG(1, "=================== END STEP 3 ===================");
-
-    DEBUG(1, "After step 3:");
-    // dump_flows();
-    DEBUG(1, "");
-    pass++;
   }
-
-  delete params;
-  return NULL;
+  return 0;
 }
 
-bool set_label(global_id prev_node, int prev_rank, local_id prev_idx,
-               local_id curr_idx, int value, int tid) {
-  // atomically set label, only if it was unset before
-  if (__sync_bool_compare_and_swap(&labels[curr_idx].value, 0, value)) {
-    // label was unset before, so go ahead and set prev pointer
-    labels[curr_idx].prev_node = prev_node;
-    labels[curr_idx].prev_rank_loc = prev_rank;
-    labels[curr_idx].prev_vert_index = prev_idx;
-    if (vertices[curr_idx].id == sink_id) {
-      return true;
-    } else {
-      // add edges to queue
-      insert_edges(curr_idx, tid);
+/**
+ * Pushes @p delta units of flow from local node @p u down an admissible edge,
+ * recording the inflow at the other end first if it is local, so it can be
+ * returned as soon as the other node is discharged.
+ */
+void dn_push_down(local_id u, bool outgoing, unsigned int edge_idx, int delta,
+                  int tid) {
+  const struct vertex vert = vertices[u];
+  if (outgoing) {
+    const struct out_edge &edge = vert.out_edges[edge_idx];
+    if (edge.rank_location == mpi_rank) {
+      size_t partner = pr_partner[vertices.out_edge_offset(u) + edge_idx];
+      __sync_fetch_and_add(
+          &dn_inflow_in[vertices.in_edge_offset(edge.vert_index) + partner],
+          delta);
+    }
+  } else {
+    const struct in_edge &edge = vert.in_edges[edge_idx];
+    if (edge.rank_location == mpi_rank) {
+      __sync_fetch_and_add(
+          &dn_inflow_out[vertices.out_edge_offset(edge.vert_index) +
+                         edge.out_index],
+          delta);
     }
   }
-  return false;
+  // remote pushes are recorded by pr_apply_messages()
+  pr_push(u, outgoing, edge_idx, delta, tid);
 }
 
-local_id handle_out_edge(const struct edge_entry &entry, int tid) {
-  local_id from_id = entry.vertex_index;
-  struct out_edge &edge = vertices[from_id].out_edges[entry.edge_index];
+/**
+ * Pushes the excess flow of local node @p u down to the next level. If it gets
+ * stuck, the node is blocked and the excess goes back where it came from.
+ */
+void dn_discharge(local_id u, int tid) {
+  const struct vertex vert = vertices[u];
+  size_t out_base = vertices.out_edge_offset(u);
+  size_t in_base = vertices.in_edge_offset(u);
+  int excess;
+  while ((excess = __atomic_load_n(&pr_excess[u], __ATOMIC_SEQ_CST)) > 0) {
+    if (pr_height[u] < dn_blocked_height()) {
+      bool outgoing;
+      unsigned int edge_idx;
+      int residual = dn_find_admissible(u, outgoing, edge_idx);
+      if (residual > 0) {
+        dn_push_down(u, outgoing, edge_idx, min(excess, residual), tid);
+      } else {
+        pr_set_height(u, dn_blocked_height() + pr_height[u], tid);
+      }
+      continue;
+    }
 
-  // always compute label locally
-  int flow_diff = edge.capacity - edge.flow;
-  if (flow_diff <= 0) {
-    return -1; // discard edge
+    // blocked, so send the excess back up the edges it came in through
+    bool returned = false;
+    for (unsigned int i = 0; i < vert.out_edges.size() && !returned; ++i) {
+      int inflow = __atomic_load_n(&dn_inflow_out[out_base + i],
+                                   __ATOMIC_SEQ_CST);
+      if (inflow > 0) {
+        int delta = min(excess, inflow);
+        __sync_fetch_and_sub(&dn_inflow_out[out_base + i], delta);
+        pr_push(u, true, i, delta, tid);
+        returned = true;
+      }
+    }
+    for (unsigned int i = 0; i < vert.in_edges.size() && !returned; ++i) {
+      int inflow =
+          __atomic_load_n(&dn_inflow_in[in_base + i], __ATOMIC_SEQ_CST);
+      if (inflow > 0) {
+        int delta = min(excess, inflow);
+        __sync_fetch_and_sub(&dn_inflow_in[in_base + i], delta);
+        pr_push(u, false, i, delta, tid);
+        returned = true;
+      }
+    }
+    if (!returned) {
+      ERROR("blocked node %llu has excess %d, but no inflow", vert.id, excess);
+      break;
+    }
   }
+}
 
-  int label_val = min(abs(labels[from_id].value), flow_diff);
-  // check if "to" node is on another rank
-  if (edge.rank_location == mpi_rank) {
-    // set label and add edges
-    if (set_label(vertices[from_id].id, mpi_rank, from_id, edge.vert_index,
-                  label_val, tid)) {
-      return edge.vert_index;
+/**
+ * Builds the level graph for a new phase, and floods the source's admissible
+ * edges. Sets @c pr_done instead if the sink can't be reached any more. Called
+ * by thread 0 on every rank at once, between rounds.
+ */
+void dn_start_phase(int tid) {
+  int n = pr_node_count();
+  vector<int> dists(vertices.size(), -1);
+  pr_bfs(sink_id, 0, dists, tid, false);
+
+  fill(pr_height_count.begin(), pr_height_count.end(), 0);
+  for (local_id v = 0; v < vertices.size(); ++v) {
+    pr_height[v] = dists[v] == -1 ? 2 * n : dists[v];
+    if (pr_height[v] < pr_counted_heights) {
+      ++pr_height_count[pr_height[v]];
     }
-  } else {
-    // send message to the owner of the "to" node
-    struct message_data msg = {
-        vertices[from_id].id, // sender's node
-        edge.dest_node_id,    // receiver's node
-        label_val,            // label value
-        pass,                 // current pass
-    };
-    // update this rank's color if necessary
-    if (edge.rank_location < mpi_rank) {
-      my_color = TOKEN_RED;
+  }
+  for (size_t t = 0; t < pr_changed.size(); ++t) {
+    pr_changed[t].clear();
+    pr_emptied[t].clear();
+  }
+  fill(pr_height_changed.begin(), pr_height_changed.end(), false);
+  for (local_id v = 0; v < vertices.size(); ++v) {
+    pr_send_height(v, tid);
+  }
+  vector<struct pr_message> inbox;
+  pr_exchange(inbox);
+  pr_apply_messages(inbox, tid);
+
+  int local_reached =
+      pr_source_idx != (local_id)-1 && dists[pr_source_idx] != -1;
+  int reached = 0;
+  MPI_Allreduce(&local_reached, &reached, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+  if (!reached) {
+    DEBUG(1, "Dinic: done after %d phases", dn_phases);
+    pr_done = true;
+    return;
+  }
+  ++dn_phases;
+
+  fill(dn_inflow_out.begin(), dn_inflow_out.end(), 0);
+  fill(dn_inflow_in.begin(), dn_inflow_in.end(), 0);
+  if (pr_source_idx != (local_id)-1) {
+    // the source has as much flow as it can send
+    bool outgoing;
+    unsigned int edge_idx;
+    int residual;
+    while ((residual = dn_find_admissible(pr_source_idx, outgoing,
+                                          edge_idx)) > 0) {
+      pr_excess[pr_source_idx] += residual;
+      dn_push_down(pr_source_idx, outgoing, edge_idx, residual, tid);
     }
-    DEBUG(2, "S2: sending msg SET_TO_LABEL to R%d", edge.rank_location);
-    MPI_Ssend(&msg, 1, MPI_MESSAGE_TYPE, edge.rank_location, SET_TO_LABEL,
-              MPI_COMM_WORLD);
   }
-  return -1;
+  pr_exchange(inbox);
+  pr_apply_messages(inbox, tid);
+  DEBUG(1, "Dinic: phase %d, source on level %d", dn_phases,
+        pr_source_idx != (local_id)-1 ? pr_height[pr_source_idx] : -1);
 }
 
-local_id handle_in_edge(const struct edge_entry &entry, int tid) {
-  local_id to_id = entry.vertex_index;
-  struct in_edge &rev_edge = vertices[to_id].in_edges[entry.edge_index];
+/**
+ * Sets up the Dinic state and starts the first phase. Called by every rank
+ * after pr_setup().
+ */
+void dn_setup() {
+  dn_inflow_out.assign(vertices.all_out_edges().size(), 0);
+  dn_inflow_in.assign(vertices.all_in_edges().size(), 0);
+  dn_phases = 0;
+  dn_start_phase(0);
+}
 
-  // check if "from" node (which holds the flow) is on another rank
-  if (rev_edge.rank_location == mpi_rank) {
-    local_id from_id = rev_edge.vert_index;
-    // find matching edge in out_edges
-    int curr_flow = -1;
-    // TODO: looping over all edges will be slow for dense graphs
-    for (auto it = vertices[from_id].out_edges.begin();
-         it != vertices[from_id].out_edges.end(); ++it) {
-      if (it->vert_index == to_id) {
-        curr_flow = it->flow;
-        break;
-      }
-    }
-    if (curr_flow <= 0) {
-      return -1; // discard edge
+/**
+ * Exchanges pushes and blocked nodes at the end of a round, and starts a new
+ * phase once the blocking flow is complete. Called by thread 0 on every rank at
+ * once.
+ */
+void dn_finish_round(int tid) {
+  for (size_t t = 0; t < pr_changed.size(); ++t) {
+    for (size_t i = 0; i < pr_changed[t].size(); ++i) {
+      local_id v = pr_changed[t][i];
+      pr_height_changed[v] = false;
+      pr_send_height(v, tid);
     }
+    pr_changed[t].clear();
+    pr_emptied[t].clear();
+  }
+  vector<struct pr_message> inbox;
+  pr_exchange(inbox);
+  pr_apply_messages(inbox, tid);
+
+  long local_pending = pr_pending;
+  long total_pending = 0;
+  MPI_Allreduce(&local_pending, &total_pending, 1, MPI_LONG, MPI_SUM,
+                MPI_COMM_WORLD);
+  DEBUG(2, "Dinic: %ld active nodes", total_pending);
+  if (total_pending == 0) {
+    dn_start_phase(tid);
+  }
+}
 
-    int label_val = -min(abs(labels[to_id].value), curr_flow);
+/// Thread body for the push-relabel and Dinic engines.
+void *run_push_relabel(struct thread_params *params) {
+  int tid = params->tid;
+  Barrier &barrier = params->barrier;
+  struct edge_entry entry = {0, true, false, 0};
 
-    // set label and add edges
-    if (set_label(vertices[to_id].id, mpi_rank, to_id, from_id, label_val,
-                  tid)) {
-      ERROR("outgoing edge from sink!");
-      return from_id;
+  while (true) {
+    // wait for the previous round to be finished
+    barrier.wait();
+    if (pr_done) {
+      break;
     }
-  } else {
-    // send message to the owner of the "from" node
-    struct message_data msg = {
-        vertices[to_id].id,    // sender's node
-        rev_edge.dest_node_id, // receiver's node
-        labels[to_id].value,   // label value
-        pass,                  // current pass
-    };
-    // update this rank's color if necessary
-    if (rev_edge.rank_location < mpi_rank) {
-      my_color = TOKEN_RED;
+    // discharge active nodes until none are left on this rank
+    while (!__atomic_load_n(&pr_round_over, __ATOMIC_SEQ_CST)) {
+      if (find_edge(entry, tid)) {
+        local_id u = entry.vertex_index;
+        if (engine == ENGINE_DINIC) {
+          dn_discharge(u, tid);
+        } else {
+          pr_discharge(u, tid);
+        }
+        __atomic_store_n(&pr_queued[u], false, __ATOMIC_SEQ_CST);
+        // flow may have been pushed to u after it was discharged
+        pr_activate(u, tid);
+        __sync_fetch_and_sub(&pr_pending, 1);
+      } else if (__atomic_load_n(&pr_pending, __ATOMIC_SEQ_CST) == 0) {
+        break;
+      } else {
+        sched_yield();
+      }
+    }
+    barrier.wait();
+    if (tid == 0) {
+      if (engine == ENGINE_DINIC) {
+        dn_finish_round(tid);
+      } else {
+        pr_finish_round(tid);
+      }
     }
-    DEBUG(2, "S2: sending msg COMPUTE_FROM_LABEL to R%d",
-          rev_edge.rank_location);
-    MPI_Ssend(&msg, 1, MPI_MESSAGE_TYPE, rev_edge.rank_location,
-              COMPUTE_FROM_LABEL, MPI_COMM_WORLD);
   }
-  return -1;
+  delete params;
+  return NULL;
 }
 
 int calc_max_flow() {
@@ -1007,30 +4156,112 @@ int calc_max_flow() {
   pthread_t threads[num_threads];
   struct thread_params shared_params = {-1, barrier};
 
-  // initialize vector of labels
-  labels = vector<struct label>(vertices.size(), EMPTY_LABEL);
+  void *(*thread_func)(struct thread_params *) = run_algorithm;
+
+  edge_deques = new WorkStealingDeque[num_threads];
+  // guided_search may be turned off later, so the heaps are kept either way
+  edge_heaps = use_edge_heaps() ? new EdgeHeap[num_threads] : NULL;
+  if (engine == ENGINE_PUSH_RELABEL) {
+    pr_setup();
+    pr_start_preflow();
+    thread_func = run_push_relabel;
+  } else if (engine == ENGINE_DINIC) {
+    pr_setup();
+    dn_setup();
+    thread_func = run_push_relabel;
+  } else {
+    // initialize vector of labels
+    labels = vector<struct label>(vertices.size(), EMPTY_LABEL);
+    labelled_nodes.assign(num_threads, vector<local_id>());
+    mirror_flow.assign(vertices.all_in_edges().size(), 0);
+    assign_border_slots();
+    label_messages_sent = 0;
+    label_messages_filtered = 0;
+    if (bidirectional_search) {
+      sink_labels = vector<struct label>(vertices.size(), EMPTY_LABEL);
+      sink_labelled_nodes.assign(num_threads, vector<local_id>());
+      int local_rank =
+          lookup_global_id(sink_id) != (local_id)-1 ? mpi_rank : -1;
+      MPI_Allreduce(&local_rank, &sink_rank, 1, MPI_INT, MPI_MAX,
+                    MPI_COMM_WORLD);
+    }
+    int local_rank =
+        lookup_global_id(source_id) != (local_id)-1 ? mpi_rank : -1;
+    MPI_Allreduce(&local_rank, &source_rank, 1, MPI_INT, MPI_MAX,
+                  MPI_COMM_WORLD);
+    MPI_Comm_dup(MPI_COMM_WORLD, &control_comms[0]);
+    MPI_Comm_dup(MPI_COMM_WORLD, &control_comms[1]);
+    if (capacity_scaling) {
+      int local_max = 1;
+      for (local_id i = 0; i < vertices.size(); ++i) {
+        for (size_t j = 0; j < vertices[i].out_edges.size(); ++j) {
+          local_max = max(local_max, vertices[i].out_edges[j].capacity);
+        }
+      }
+      int max_capacity = 1;
+      MPI_Allreduce(&local_max, &max_capacity, 1, MPI_INT, MPI_MAX,
+                    MPI_COMM_WORLD);
+      scaling_delta = 1;
+      while (scaling_delta <= max_capacity / 2) {
+        scaling_delta *= 2;
+      }
+      if (mpi_rank == 0) {
+        cout << "Initial scaling delta: " << scaling_delta << endl;
+      }
+    }
+    label_batches = new struct label_batch[LABEL_TAG_COUNT * mpi_size];
+    if (level_synchronous) {
+      sweep_parents.assign(num_threads, vector<struct bottom_up_parent>());
+      level_outboxes.assign(
+          num_threads,
+          vector<vector<struct message_data>>(LABEL_TAG_COUNT * mpi_size));
+    }
+    start_label_comm();
+  }
 
   // spawn threads
   for (size_t i = 0; i < num_threads; i++) {
     auto *params = new struct thread_params(shared_params);
     params->tid = i;
-    pthread_create(&threads[i], NULL, (void *(*)(void *))run_algorithm,
+    pthread_create(&threads[i], NULL, (void *(*)(void *))thread_func,
                    (void *)params);
   }
   // wait for threads to finish
   for (size_t i = 0; i < num_threads; ++i) {
     pthread_join(threads[i], NULL);
   }
+  delete[] edge_deques;
+  delete[] edge_heaps;
+  if (engine == ENGINE_FORD_FULKERSON) {
+    delete[] label_batches;
+    stop_label_comm();
+    MPI_Comm_free(&control_comms[0]);
+    MPI_Comm_free(&control_comms[1]);
+    long local_counts[2] = {label_messages_sent, label_messages_filtered};
+    long counts[2] = {0, 0};
+    MPI_Reduce(local_counts, counts, 2, MPI_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+    if (mpi_rank == 0) {
+      cout << "Label messages: " << counts[0] << " sent, " << counts[1]
+           << " left out as duplicates" << endl;
+    }
+  }
 
   cout << "Calculation complete!\n";
 
-  // sum up flow out of source node
-  local_id src_idx = lookup_global_id(source_id);
   int total_flow = -1;
-  if (src_idx != (local_id)-1) {
-    total_flow = 0;
-    for (local_id i = 0; i < vertices[src_idx].out_edges.size(); ++i) {
-      total_flow += vertices[src_idx].out_edges[i].flow;
+  if (engine != ENGINE_FORD_FULKERSON) {
+    // all the flow ends up at the sink
+    if (pr_sink_idx != (local_id)-1) {
+      total_flow = pr_excess[pr_sink_idx];
+    }
+  } else {
+    // sum up flow out of source node
+    local_id src_idx = lookup_global_id(source_id);
+    if (src_idx != (local_id)-1) {
+      total_flow = 0;
+      for (local_id i = 0; i < vertices[src_idx].out_edges.size(); ++i) {
+        total_flow += vertices[src_idx].out_edges[i].flow;
+      }
     }
   }
   // send to rank 0
@@ -1052,53 +4283,402 @@ int calc_max_flow() {
   return total_flow;
 }
 
-// Read in an adjacency list file into network
-// Return the vertex count, or 0 if there was an error
-global_id read_file(const string &filepath) {
-  ifstream file(filepath.c_str());
-  if (!file)
+/*********** Parallel Graph Loading ***************/
+
+/**
+ * Every rank reads a contiguous block of vertices from the input file, so no
+ * rank ever holds the whole graph. The blocks are only used until Zoltan
+ * repartitions the graph.
+ */
+
+/// First vertex ID read by each rank, followed by the total vertex count
+vector<global_id> block_starts;
+
+/// Returns the rank that read vertex @p id from the input file.
+int block_owner(global_id id) {
+  return upper_bound(block_starts.begin(), block_starts.end(), id) -
+         block_starts.begin() - 1;
+}
+
+/// Largest number of bytes read by a single MPI-IO call
+#define MAX_READ_SIZE (1 << 30)
+
+/**
+ * Collectively reads @p bytes bytes at @p offset in @p file into @p buf, in
+ * pieces small enough for an @c int count. Must be called by every rank at
+ * once, but the sizes may differ.
+ */
+void read_at_all(MPI_File file, MPI_Offset offset, char *buf, size_t bytes) {
+  long pieces = (bytes + MAX_READ_SIZE - 1) / MAX_READ_SIZE;
+  long max_pieces = 0;
+  MPI_Allreduce(&pieces, &max_pieces, 1, MPI_LONG, MPI_MAX, MPI_COMM_WORLD);
+  for (long i = 0; i < max_pieces; ++i) {
+    size_t start = min((size_t)i * MAX_READ_SIZE, bytes);
+    size_t length = min((size_t)MAX_READ_SIZE, bytes - start);
+    MPI_File_read_at_all(file, offset + start, buf + start, length, MPI_BYTE,
+                         MPI_STATUS_IGNORE);
+  }
+}
+
+/**
+ * Reads this rank's block of vertices from an adjacency list file with MPI-IO.
+ * Each rank reads an equal byte range, and takes the lines that start in it.
+ * An exclusive scan over the line counts then tells every rank which vertex
+ * its first line belongs to.
+ *
+ * @return The vertex count, or 0 if there was an error
+ */
+global_id load_adj_block(const string &filepath) {
+  MPI_File file;
+  if (MPI_File_open(MPI_COMM_WORLD, filepath.c_str(), MPI_MODE_RDONLY,
+                    MPI_INFO_NULL, &file) != MPI_SUCCESS)
+    return 0;
+  MPI_Offset file_size;
+  MPI_File_get_size(file, &file_size);
+  MPI_Offset start = file_size * mpi_rank / mpi_size;
+  MPI_Offset end = file_size * (mpi_rank + 1) / mpi_size;
+
+  // also read the byte before our range, to tell if a line starts at `start`
+  MPI_Offset read_start = start > 0 ? start - 1 : 0;
+  vector<char> text(end - read_start);
+  read_at_all(file, read_start, text.data(), text.size());
+  size_t range_end = text.size();
+  size_t first = 0;
+  if (start > 0) {
+    first = find(text.begin(), text.end(), '\n') - text.begin() + 1;
+  }
+  // finish the last line, which may run into the next rank's range
+  if (first < range_end && text.back() != '\n') {
+    const size_t chunk_size = 64 * 1024;
+    MPI_Offset pos = end;
+    while (pos < file_size) {
+      size_t length = min((MPI_Offset)chunk_size, file_size - pos);
+      size_t old_size = text.size();
+      text.resize(old_size + length);
+      MPI_File_read_at(file, pos, text.data() + old_size, length, MPI_BYTE,
+                       MPI_STATUS_IGNORE);
+      pos += length;
+      auto newline = find(text.begin() + old_size, text.end(), '\n');
+      if (newline != text.end()) {
+        text.resize(newline - text.begin() + 1);
+        break;
+      }
+    }
+  }
+  MPI_File_close(&file);
+  // split into NUL-terminated lines
+  text.push_back('\0');
+  vector<size_t> lines;
+  for (size_t i = first; i < range_end; ++i) {
+    if (i == first || text[i - 1] == '\0') {
+      lines.push_back(i);
+    }
+    if (text[i] == '\n') {
+      text[i] = '\0';
+    }
+  }
+  for (size_t i = range_end; i < text.size(); ++i) {
+    if (text[i] == '\n') {
+      text[i] = '\0';
+    }
+  }
+
+  long line_count = lines.size();
+  long first_line = 0;
+  MPI_Exscan(&line_count, &first_line, 1, MPI_LONG, MPI_SUM, MPI_COMM_WORLD);
+  if (mpi_rank == 0) {
+    first_line = 0;
+  }
+
+  // First line: number vertices and number edges
+  global_id num_vertices = 0;
+  if (mpi_rank == 0 && !lines.empty()) {
+    num_vertices = strtoull(text.data() + lines[0], NULL, 10);
+  }
+  MPI_Bcast(&num_vertices, 1, GLOBAL_ID_TYPE, 0, MPI_COMM_WORLD);
+  if (num_vertices == 0)
     return 0;
 
-  // Read first line: number vertices and number edges
-  string line;
-  if (!getline(file, line))
+  // line i + 1 holds the "to" node and capacity of each out-edge of vertex i
+  global_id first_id =
+      min((global_id)max(first_line - 1, 0L), num_vertices);
+  global_id last_id = first_id;
+  bool ok = true;
+  for (size_t l = 0; l < lines.size() && ok; ++l) {
+    if (first_line + (long)l == 0) {
+      continue; // the header
+    }
+    if (last_id == num_vertices) {
+      break;
+    }
+    vertices.add_vertex(last_id++);
+    const char *pos = text.data() + lines[l];
+    char *next;
+    while (true) {
+      global_id dest = strtoull(pos, &next, 10);
+      if (next == pos)
+        break;
+      pos = next;
+      int capacity = strtol(pos, &next, 10);
+      if (next == pos)
+        break;
+      pos = next;
+      if (dest >= num_vertices) {
+        cout << "Edge to vertex " << dest << " is out of range" << endl;
+        ok = false;
+        break;
+      }
+      struct out_edge out_temp = {dest, 0, (local_id)-1, capacity, 0};
+      vertices.push_out_edge(out_temp);
+    }
+  }
+  // vertices without a line in the file have no out-edges
+  if (mpi_rank == mpi_size - 1) {
+    while (last_id < num_vertices) {
+      vertices.add_vertex(last_id++);
+    }
+  }
+
+  block_starts.resize(mpi_size + 1);
+  MPI_Allgather(&first_id, 1, GLOBAL_ID_TYPE, block_starts.data(), 1,
+                GLOBAL_ID_TYPE, MPI_COMM_WORLD);
+  block_starts[mpi_size] = num_vertices;
+  return ok ? num_vertices : 0;
+}
+
+/**
+ * Reads this rank's block of vertices from a binary CSR file (see
+ * graph-file.h). The file is mapped on every rank, but each rank only touches
+ * the pages holding its own slice of the arrays.
+ *
+ * @return The vertex count, or 0 if there was an error
+ */
+global_id load_csr_block(const string &filepath) {
+  MappedGraphFile file;
+  if (!file.open(filepath)) {
+    cout << "Could not map " << filepath << " as a graph file" << endl;
+    return 0;
+  }
+  global_id num_vertices = file.vertex_count();
+  global_id first_id = num_vertices * mpi_rank / mpi_size;
+  global_id end_id = num_vertices * (mpi_rank + 1) / mpi_size;
+  if (!file.offsets_valid(first_id, end_id)) {
+    cout << "Edge offsets of vertices " << first_id << " to " << end_id
+         << " are out of order or out of range" << endl;
     return 0;
-  global_id num_vertices;
-  size_t num_edges;
-  istringstream iss_(line);
-  iss_ >> num_vertices >> num_edges;
+  }
+  const uint64_t *offsets = file.offsets();
+  const uint64_t *destinations = file.destinations();
+  const int32_t *capacities = file.capacities();
+
+  vertices.reserve(end_id - first_id, offsets[end_id] - offsets[first_id]);
+  for (global_id i = first_id; i < end_id; ++i) {
+    vertices.add_vertex(i);
+    for (uint64_t j = offsets[i]; j < offsets[i + 1]; ++j) {
+      if (destinations[j] >= num_vertices) {
+        cout << "Edge to vertex " << destinations[j] << " is out of range"
+             << endl;
+        return 0;
+      }
+      struct out_edge out_temp = {destinations[j], 0, (local_id)-1,
+                                  capacities[j], 0};
+      vertices.push_out_edge(out_temp);
+    }
+  }
 
-  // Initialize all vertices so that their in and out edges can be added to
-  struct vertex temp;
-  for (global_id i = 0; i < num_vertices; i++) {
-    temp.id = i;
-    vertices.push_back(temp);
+  block_starts.resize(mpi_size + 1);
+  for (int r = 0; r <= mpi_size; ++r) {
+    block_starts[r] = num_vertices * r / mpi_size;
   }
+  return num_vertices;
+}
+
+/// An in-edge on its way to the rank that read its "to" node
+struct in_edge_record {
+  global_id to;
+  global_id from;
+  global_id out_index;
+};
+MPI_Datatype MPI_IN_EDGE_RECORD_TYPE;
 
-  // Read every line
-  global_id curr_index = 0; // Track the current index
-  while (getline(file, line)) {
-    // Read in every vertex, capacity pair
-    istringstream iss(line);
-    global_id connected_vertex;
-    int capacity;
-    while (iss >> connected_vertex >> capacity) {
-      // Create new matching in and out edges
-      struct out_edge out_temp = {connected_vertex, 0, (local_id)-1, capacity,
-                                  0};
-      vertices[curr_index].out_edges.push_back(out_temp);
+/**
+ * Creates the matching in-edge of every out-edge read by any rank, and sends
+ * it to the rank holding its "to" node. The in-edges of each node end up in
+ * order of increasing "from" node. Also sets the rank location of every edge.
+ *
+ * @return @c true on success, or @c false on every rank if any rank has more
+ *         in-edges to send or receive than MPI can count
+ */
+bool build_in_edges() {
+  global_id first_id = block_starts[mpi_rank];
+  vector<int> send_counts(mpi_size, 0);
+  vector<int> recv_counts(mpi_size, 0);
+  EdgeRange<struct out_edge> out_edges = vertices.all_out_edges();
+  for (auto it = out_edges.begin(); it != out_edges.end(); ++it) {
+    it->rank_location = block_owner(it->dest_node_id);
+  }
+  // the counts and displacements are in records, and must fit in an int
+  int local_ok = out_edges.size() <= (size_t)INT_MAX;
+  if (local_ok) {
+    for (auto it = out_edges.begin(); it != out_edges.end(); ++it) {
+      send_counts[it->rank_location]++;
+    }
+  }
+  MPI_Alltoall(send_counts.data(), 1, MPI_INT, recv_counts.data(), 1, MPI_INT,
+               MPI_COMM_WORLD);
+  size_t recv_total = 0;
+  for (int i = 0; i < mpi_size; ++i) {
+    recv_total += recv_counts[i];
+  }
+  if (recv_total > (size_t)INT_MAX) {
+    local_ok = 0;
+  }
+  int ok = 0;
+  MPI_Allreduce(&local_ok, &ok, 1, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
+  if (!ok) {
+    if (!local_ok)
+      cout << "Too many in-edges to exchange on rank " << mpi_rank << endl;
+    return false;
+  }
+  vector<int> send_displs(mpi_size, 0);
+  vector<int> recv_displs(mpi_size, 0);
+  for (int i = 1; i < mpi_size; ++i) {
+    send_displs[i] = send_displs[i - 1] + send_counts[i - 1];
+    recv_displs[i] = recv_displs[i - 1] + recv_counts[i - 1];
+  }
+  vector<struct in_edge_record> outgoing(out_edges.size());
+  vector<struct in_edge_record> incoming(recv_total);
+  vector<int> cursor(send_displs);
+  for (local_id i = 0; i < vertices.size(); ++i) {
+    const struct vertex v = vertices[i];
+    for (unsigned int j = 0; j < v.out_edges.size(); ++j) {
+      // the edge order of each node never changes, so out_index stays valid
+      // after partitioning
+      struct in_edge_record record = {v.out_edges[j].dest_node_id, v.id, j};
+      outgoing[cursor[v.out_edges[j].rank_location]++] = record;
+    }
+  }
+  MPI_Alltoallv(outgoing.data(), send_counts.data(), send_displs.data(),
+                MPI_IN_EDGE_RECORD_TYPE, incoming.data(), recv_counts.data(),
+                recv_displs.data(), MPI_IN_EDGE_RECORD_TYPE, MPI_COMM_WORLD);
+  outgoing.clear();
+
+  // records arrive sorted by "from" node within each sender, and the senders
+  // hold increasing ranges of nodes, so a counting sort on the "to" node keeps
+  // them in order of increasing "from" node
+  vector<size_t> in_offsets(vertices.size() + 1, 0);
+  for (size_t k = 0; k < incoming.size(); ++k) {
+    in_offsets[incoming[k].to - first_id + 1]++;
+  }
+  for (local_id i = 0; i < vertices.size(); ++i) {
+    in_offsets[i + 1] += in_offsets[i];
+  }
+  vector<struct in_edge> in_edges(incoming.size());
+  vector<size_t> in_cursor(in_offsets.begin(), in_offsets.end() - 1);
+  for (size_t k = 0; k < incoming.size(); ++k) {
+    const struct in_edge_record &record = incoming[k];
+    struct in_edge in_temp = {record.from, block_owner(record.from),
+                              (local_id)-1, (unsigned int)record.out_index};
+    in_edges[in_cursor[record.to - first_id]++] = in_temp;
+  }
+  vertices.assign_in_edges(in_offsets, in_edges);
+  return true;
+}
 
-      struct in_edge in_temp = {(global_id)curr_index, 0, (local_id)-1};
-      vertices[connected_vertex].in_edges.push_back(in_temp);
+/**
+ * Sets the rank location and local index of every edge after partitioning.
+ *
+ * Instead of every rank keeping the new rank of every node, the rank that read
+ * a node acts as its directory entry: each rank only asks about the nodes on
+ * other ranks that share an edge with it, so memory use scales with the size
+ * of the local partition rather than the whole graph.
+ *
+ * @param block_ranks The new rank of each node this rank read
+ */
+void resolve_edge_ranks(const vector<int> &block_ranks) {
+  global_id first_id = block_starts[mpi_rank];
+  // find the border nodes, in order of the rank that read them
+  vector<global_id> border;
+  EdgeRange<struct out_edge> out_edges = vertices.all_out_edges();
+  EdgeRange<struct in_edge> in_edges = vertices.all_in_edges();
+  for (auto it = out_edges.begin(); it != out_edges.end(); ++it) {
+    if (global_to_local.find(it->dest_node_id) == (local_id)-1) {
+      border.push_back(it->dest_node_id);
+    }
+  }
+  for (auto it = in_edges.begin(); it != in_edges.end(); ++it) {
+    if (global_to_local.find(it->dest_node_id) == (local_id)-1) {
+      border.push_back(it->dest_node_id);
     }
+  }
+  sort(border.begin(), border.end());
+  border.erase(unique(border.begin(), border.end()), border.end());
 
-    curr_index += 1;
+  vector<int> send_counts(mpi_size, 0);
+  vector<int> recv_counts(mpi_size, 0);
+  for (size_t i = 0; i < border.size(); ++i) {
+    send_counts[block_owner(border[i])]++;
   }
+  MPI_Alltoall(send_counts.data(), 1, MPI_INT, recv_counts.data(), 1, MPI_INT,
+               MPI_COMM_WORLD);
+  vector<int> send_displs(mpi_size, 0);
+  vector<int> recv_displs(mpi_size, 0);
+  for (int i = 1; i < mpi_size; ++i) {
+    send_displs[i] = send_displs[i - 1] + send_counts[i - 1];
+    recv_displs[i] = recv_displs[i - 1] + recv_counts[i - 1];
+  }
+  vector<global_id> queries(recv_displs[mpi_size - 1] +
+                            recv_counts[mpi_size - 1]);
+  MPI_Alltoallv(border.data(), send_counts.data(), send_displs.data(),
+                GLOBAL_ID_TYPE, queries.data(), recv_counts.data(),
+                recv_displs.data(), GLOBAL_ID_TYPE, MPI_COMM_WORLD);
+
+  // answer with the new rank of each node, in the same order
+  vector<int> answers(queries.size());
+  for (size_t i = 0; i < queries.size(); ++i) {
+    answers[i] = block_ranks[queries[i] - first_id];
+  }
+  vector<int> border_ranks(border.size());
+  MPI_Alltoallv(answers.data(), recv_counts.data(), recv_displs.data(),
+                MPI_INT, border_ranks.data(), send_counts.data(),
+                send_displs.data(), MPI_INT, MPI_COMM_WORLD);
+
+  GlobalIdMap border_index;
+  border_index.assign(border);
+  for (auto it = out_edges.begin(); it != out_edges.end(); ++it) {
+    // update rank location of the "to" node
+    it->vert_index = global_to_local.find(it->dest_node_id);
+    it->rank_location =
+        it->vert_index != (local_id)-1
+            ? mpi_rank
+            : border_ranks[border_index.find(it->dest_node_id)];
+  }
+  for (auto it = in_edges.begin(); it != in_edges.end(); ++it) {
+    // update rank location of the "from" node
+    it->vert_index = global_to_local.find(it->dest_node_id);
+    it->rank_location =
+        it->vert_index != (local_id)-1
+            ? mpi_rank
+            : border_ranks[border_index.find(it->dest_node_id)];
+  }
+}
 
+/**
+ * Loads this rank's block of the graph file, in either format.
+ *
+ * @return The vertex count, or 0 if any rank had an error
+ */
+global_id load_graph(const string &filepath) {
+  global_id num_vertices = is_csr_file(filepath) ? load_csr_block(filepath)
+                                                 : load_adj_block(filepath);
+  int local_ok = num_vertices != 0;
+  int ok = 0;
+  MPI_Allreduce(&local_ok, &ok, 1, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
+  if (!ok || !build_in_edges())
+    return 0;
   return num_vertices;
 }
 
-// For now going to assume all ranks will load the entire graph
 int main(int argc, char **argv) {
   int mpi_thread_support;
   MPI_Init_thread(&argc, &argv, MPI_THREAD_MULTIPLE, &mpi_thread_support);
@@ -1112,39 +4692,110 @@ int main(int argc, char **argv) {
 
   {
     // create MPI datatype for inter-rank messages
-    const int count = 2;
-    int block_lengths[count] = {2, 2};
-    MPI_Datatype types[count] = {GLOBAL_ID_TYPE, MPI_INT};
+    const int count = 4;
+    int block_lengths[count] = {2, 2, 1, 1};
+    MPI_Datatype types[count] = {GLOBAL_ID_TYPE, MPI_INT, MPI_UNSIGNED,
+                                 GLOBAL_ID_TYPE};
     MPI_Aint offsets[count] = {offsetof(message_data, senders_node),
-                               offsetof(message_data, value)};
+                               offsetof(message_data, value),
+                               offsetof(message_data, edge_index),
+                               offsetof(message_data, branch)};
     MPI_Type_create_struct(count, block_lengths, offsets, types,
                            &MPI_MESSAGE_TYPE);
     MPI_Type_commit(&MPI_MESSAGE_TYPE);
   }
-
-  // Initialize Network
-  // Root rank will handle partitioning, file reading, broadcasting rank map
+  {
+    // create MPI datatype for push-relabel messages
+    const int count = 3;
+    int block_lengths[count] = {1, 2, 1};
+    MPI_Datatype types[count] = {GLOBAL_ID_TYPE, MPI_INT, MPI_UNSIGNED};
+    MPI_Aint offsets[count] = {offsetof(pr_message, vertex),
+                               offsetof(pr_message, kind),
+                               offsetof(pr_message, edge_index)};
+    MPI_Datatype packed;
+    MPI_Type_create_struct(count, block_lengths, offsets, types, &packed);
+    // include the trailing padding, so arrays of messages line up
+    MPI_Type_create_resized(packed, 0, sizeof(struct pr_message),
+                            &MPI_PR_MESSAGE_TYPE);
+    MPI_Type_free(&packed);
+    MPI_Type_commit(&MPI_PR_MESSAGE_TYPE);
+  }
+  // create MPI datatype for in-edges sent while loading the graph
+  MPI_Type_contiguous(3, GLOBAL_ID_TYPE, &MPI_IN_EDGE_RECORD_TYPE);
+  MPI_Type_commit(&MPI_IN_EDGE_RECORD_TYPE);
 
   // check arguments
-  if (argc != 3) {
+  if (argc < 3 || argc > 8) {
     if (mpi_rank == 0)
       cout << "ERROR: Was expecting " << argv[0]
-           << " filepath_to_input num_threads" << endl;
+           << " filepath_to_input num_threads"
+           << " [ff|ff-bidir|push-relabel|dinic] [scaling] [widest] [levels]"
+           << " [astar]" << endl;
     MPI_Abort(MPI_COMM_WORLD, 1);
   }
   num_threads = atoi(argv[2]);
+  if (argc >= 4) {
+    if (strcmp(argv[3], "push-relabel") == 0) {
+      engine = ENGINE_PUSH_RELABEL;
+    } else if (strcmp(argv[3], "dinic") == 0) {
+      engine = ENGINE_DINIC;
+    } else if (strcmp(argv[3], "ff-bidir") == 0) {
+      bidirectional_search = true;
+    } else if (strcmp(argv[3], "ff") != 0) {
+      if (mpi_rank == 0)
+        cout << "ERROR: Unknown algorithm " << argv[3] << endl;
+      MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+  }
+  // options for the Ford-Fulkerson engine
+  for (int i = 4; i < argc; ++i) {
+    if (strcmp(argv[i], "scaling") == 0 && engine == ENGINE_FORD_FULKERSON) {
+      capacity_scaling = true;
+    } else if (strcmp(argv[i], "widest") == 0 &&
+               engine == ENGINE_FORD_FULKERSON) {
+      widest_path = true;
+    } else if (strcmp(argv[i], "levels") == 0 &&
+               engine == ENGINE_FORD_FULKERSON) {
+      level_synchronous = true;
+    } else if (strcmp(argv[i], "astar") == 0 &&
+               engine == ENGINE_FORD_FULKERSON) {
+      guided_search = true;
+    } else {
+      if (mpi_rank == 0)
+        cout << "ERROR: Unknown option " << argv[i] << " for " << argv[3]
+             << endl;
+      MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+  }
+  if (widest_path && guided_search) {
+    if (mpi_rank == 0)
+      cout << "ERROR: widest and astar can't be used together" << endl;
+    MPI_Abort(MPI_COMM_WORLD, 1);
+  }
+  // Every rank reads its own block of the graph
   if (mpi_rank == 0) {
-    graph_node_count = read_file(argv[1]);
-    if (graph_node_count == 0) {
+    g_start_cycles = GetTimeBase();
+  }
+  graph_node_count = load_graph(argv[1]);
+  if (graph_node_count == 0) {
+    if (mpi_rank == 0)
       cout << "Error reading file" << endl;
-      MPI_Abort(MPI_COMM_WORLD, 2);
-    }
-  } else {
-    // Nothing for other ranks, wait for partitioning
+    MPI_Abort(MPI_COMM_WORLD, 2);
+  }
+  if (engine != ENGINE_FORD_FULKERSON && graph_node_count > PR_MAX_NODE_COUNT) {
+    if (mpi_rank == 0)
+      cout << "ERROR: " << argv[3] << " supports at most " << PR_MAX_NODE_COUNT
+           << " nodes, but the graph has " << graph_node_count << endl;
+    MPI_Abort(MPI_COMM_WORLD, 2);
+  }
+  if (mpi_rank == 0) {
+    g_end_cycles = GetTimeBase();
+    g_time_in_secs =
+        ((double)(g_end_cycles - g_start_cycles) / g_processor_frequency);
+    cout << "Read time: " << g_time_in_secs << endl;
   }
 
   printf("rank=%d, size=%d\n", mpi_rank, mpi_size);
-  MPI_Bcast(&graph_node_count, 1, GLOBAL_ID_TYPE, 0, MPI_COMM_WORLD);
   // printf("Ready to partition\n");
   printf("graph_node_count: %llu\n", graph_node_count);
 
@@ -1181,7 +4832,8 @@ int main(int argc, char **argv) {
   Zoltan_Set_Param(zz, "DEBUG_LEVEL", "0");
 
   // Initialize Network
-  // Root rank will handle partitioning, file reading, broadcasting rank map
+  // Every rank moves its block of vertices to their new ranks, then all ranks
+  // share the map of where each vertex went
 
   // Start recording time base for partitioning
   if (mpi_rank == 0) {
@@ -1227,28 +4879,21 @@ int main(int argc, char **argv) {
   //   }
   // }
 
-  // Process the map of where vertices went and remove exported vertices
-  if (mpi_rank == 0) {
-    global_id_to_rank = export_processors;
-
-    for (long long i = vertices.size() - 1; i >= 0; i--) { // Iterate in reverse
-      // Remove from this rank if it was exported
-      if (export_processors[i] != mpi_rank) {
-        // printf(
-        //     "r%d: removing exported network[%lld]=%llu. Was exported to
-        //     %d\n", mpi_rank, i, vertices[i].id, export_processors[i]);
-        vertices.erase(vertices.begin() + i);
-      }
-    }
-  } else {
-    global_id_to_rank = new int[graph_node_count];
+  // Process the map of where vertices went and remove exported vertices.
+  // With RETURN_LISTS set to PARTS, the export list holds every vertex this
+  // rank read, and the imported vertices were appended after them.
+  global_id first_id = block_starts[mpi_rank];
+  local_id block_size = block_starts[mpi_rank + 1] - first_id;
+  vector<int> block_ranks(block_size, mpi_rank);
+  for (int i = 0; i < num_exported; i++) {
+    block_ranks[export_global_ids[i] - first_id] = export_processors[i];
   }
-  // MPI_Barrier(MPI_COMM_WORLD);
-  // MPI_Bcast(&total_network_size, 1, MPI_INT, 0, MPI_COMM_WORLD);
-  // printf("r%d: Next?\n", mpi_rank);
-  // Broadcast array of export_processors essentially.
-  // Indices represent vertex IDs, values represent the rank they're on
-  MPI_Bcast(global_id_to_rank, graph_node_count, MPI_INT, 0, MPI_COMM_WORLD);
+  // Remove from this rank if it was exported
+  vector<bool> keep(vertices.size(), true);
+  for (local_id i = 0; i < block_size; i++) {
+    keep[i] = block_ranks[i] == mpi_rank;
+  }
+  vertices.compact(keep);
 
   // Print out all contents for testing
   // for (local_id i = 0; i < vertices.size(); i++) {
@@ -1258,29 +4903,16 @@ int main(int argc, char **argv) {
   // }
 
   // construct global-to-local ID lookup
-  for (local_id i = 0; i < vertices.size(); ++i) {
-    global_to_local[vertices[i].id] = i;
+  {
+    vector<global_id> local_ids(vertices.size());
+    for (local_id i = 0; i < vertices.size(); ++i) {
+      local_ids[i] = vertices[i].id;
+    }
+    global_to_local.assign(local_ids);
   }
 
   // update all local indices and rank locations in all edges
-  for (auto v_it = vertices.begin(); v_it != vertices.end(); ++v_it) {
-    for (auto it = v_it->out_edges.begin(); it != v_it->out_edges.end(); ++it) {
-      // update rank location of the "to" node
-      it->rank_location = global_id_to_rank[it->dest_node_id];
-      if (it->rank_location == mpi_rank) {
-        // "to" node is on this rank, store local index
-        it->vert_index = global_to_local[it->dest_node_id];
-      }
-    }
-    for (auto it = v_it->in_edges.begin(); it != v_it->in_edges.end(); ++it) {
-      // update rank location of the "from" node
-      it->rank_location = global_id_to_rank[it->dest_node_id];
-      if (it->rank_location == mpi_rank) {
-        // "from" node is on this rank, store local index
-        it->vert_index = global_to_local[it->dest_node_id];
-      }
-    }
-  }
+  resolve_edge_ranks(block_ranks);
 
   // Stop timer
   if (mpi_rank == 0) {
@@ -1313,8 +4945,6 @@ int main(int argc, char **argv) {
   if (mpi_rank == 0) {
     cout << "\nMax flow: " << max_flow << endl;
     cout << "Runtime: " << g_time_in_secs << endl;
-  } else {
-    delete[] global_id_to_rank;
   }
 
   /*Begin closing/freeing things*/